@@ -17,6 +17,7 @@ struct ExecQueue::Task
 ExecQueue::ExecQueue()
     : m_destroying(false),
       m_cancellingCurrentTask(false),
+      m_currentControl(nullptr),
       m_execThread(&ExecQueue::ExecLoop, this)
 {
 }
@@ -26,6 +27,11 @@ ExecQueue::~ExecQueue()
     {
         std::lock_guard<std::mutex> lock(m_mtx);
         m_destroying = true;
+
+        if (m_currentControl != nullptr)
+        {
+            m_currentControl->Cancel();
+        }
     }
 
     m_execThread.join();
@@ -51,12 +57,11 @@ void ExecQueue::AddBatch(const std::vector<QString>& batch, unsigned firstTaskId
 
 void ExecQueue::ExecLoop()
 {
-    auto isCancelling = std::bind(&ExecQueue::IsCancelling, this);
-
     while (!m_destroying)
     {
         TaskPtr currTask;
         Abacus::State state;
+        Abacus::ExecControl control;
 
         {
             std::unique_lock<std::mutex> lock(m_mtx);
@@ -66,6 +71,7 @@ void ExecQueue::ExecLoop()
                 currTask = std::move(m_waitingTasks.front());
                 m_waitingTasks.pop_front();
                 m_cancellingCurrentTask = false;
+                m_currentControl = &control;
 
                 state = m_doneTasks.empty() ?
                             Abacus::State() : m_doneTasks.back().get()->State;
@@ -80,7 +86,7 @@ void ExecQueue::ExecLoop()
         {
             Task& task = *currTask.get();
 
-            Abacus::ExecResult taskResult = Abacus::Execute(task.Statement.toStdString(), state, isCancelling);
+            Abacus::ExecResult taskResult = Abacus::Execute(task.Statement.toStdString(), state, &control);
             task.IsSuccessfull = taskResult.Brief == Abacus::ResultBrief::SUCCEEDED;
             task.Preview = task.IsSuccessfull ? "Ok. " : "Error: ";
 
@@ -131,6 +137,8 @@ void ExecQueue::ExecLoop()
             {
                 std::lock_guard<std::mutex> lock(m_mtx);
 
+                m_currentControl = nullptr;
+
                 if (!m_cancellingCurrentTask)
                 {
                     m_doneTasks.push_back(std::move(currTask));
@@ -170,6 +178,11 @@ void ExecQueue::CancelTasksImpl(unsigned fromTaskIdx)
     {
         qInfo("Cancelled current task %u", fromTaskIdx);
         m_cancellingCurrentTask = true;
+
+        if (m_currentControl != nullptr)
+        {
+            m_currentControl->Cancel();
+        }
     }
     else
     {
@@ -183,9 +196,3 @@ void ExecQueue::CancelTasksImpl(unsigned fromTaskIdx)
         m_doneTasks.pop_back();
     }
 }
-
-bool ExecQueue::IsCancelling() const
-{
-    std::lock_guard<std::mutex> lock(m_mtx);
-    return m_destroying || m_cancellingCurrentTask;
-}
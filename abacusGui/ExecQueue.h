@@ -12,6 +12,11 @@
 #include <memory>
 #include <condition_variable>
 
+namespace Abacus
+{
+    class ExecControl;
+}
+
 
 class ExecQueue : public QObject
 {
@@ -36,7 +41,6 @@ private:
 
     void ExecLoop();
     void CancelTasksImpl(unsigned fromTaskIdx);
-    bool IsCancelling() const;
 
     struct Task;
     typedef std::unique_ptr<Task> TaskPtr;
@@ -47,6 +51,9 @@ private:
     bool m_destroying;
     bool m_cancellingCurrentTask;
 
+    // Control of the task which is being executed, nullptr between tasks.
+    Abacus::ExecControl* m_currentControl;
+
     mutable std::mutex m_mtx;
     std::condition_variable m_wakeup;
     std::thread m_execThread;
@@ -0,0 +1,103 @@
+#pragma once
+
+#include "Universal.h"
+
+#include <tao/pegtl.hpp>
+
+#include <memory>
+#include <string>
+#include <vector>
+
+namespace Abacus
+{
+  namespace Ast
+  {
+    using tao::TAOCPP_PEGTL_NAMESPACE::position;
+
+    enum class Operators : unsigned char
+    {
+      ADD,
+      SUB,
+      MUL,
+      DIV,
+      POW
+    };
+
+    struct Node;
+    typedef std::unique_ptr<Node> NodePtr;
+
+    /** @brief Scope describes identifiers which are visible in an expression. */
+    struct Scope
+    {
+      /** @brief Variables are not visible in lambdas because lambdas have no closure. */
+      bool HasVariables;
+
+      /** @brief Names of lambda parameters. Index of a name is a slot of the parameter. */
+      std::vector<std::string> Parameters;
+    };
+
+    /** @brief Lambda is a parsed map() or reduce() operation. */
+    struct Lambda
+    {
+      Scope Params;
+      NodePtr Body;
+    };
+
+    /** @brief Node is an element of expression tree. */
+    struct Node
+    {
+      enum class Kinds : unsigned char
+      {
+        CONSTANT,   // Value
+        VARIABLE,   // Name
+        PARAMETER,  // Slot
+        BINARY_OP,  // Args[0] Operator Args[1]
+        SEQUENCE,   // { Args[0], Args[1] }
+        MAP,        // map(Args[0], Func)
+        REDUCE      // reduce(Args[0], Args[1], Func)
+      };
+
+      Node(Kinds kind, const position& pos)
+        : Kind(kind), Pos(pos), Slot(0U), Operator(Operators::ADD)
+      { }
+
+      Kinds Kind;
+      position Pos;
+
+      Universal Value;
+      std::string Name;
+      unsigned Slot;
+      Operators Operator;
+
+      std::vector<NodePtr> Args;
+      std::unique_ptr<Lambda> Func;
+    };
+
+    inline NodePtr MakeNode(Node::Kinds kind, const position& pos)
+    {
+      return NodePtr(new Node(kind, pos));
+    }
+
+    /** @brief Returns deep copy of the tree. */
+    inline NodePtr Clone(const Node& node)
+    {
+      NodePtr copy = MakeNode(node.Kind, node.Pos);
+      copy->Value = node.Value;
+      copy->Name = node.Name;
+      copy->Slot = node.Slot;
+      copy->Operator = node.Operator;
+
+      for (const auto& arg : node.Args)
+      {
+        copy->Args.push_back(Clone(*arg));
+      }
+
+      if (node.Func != nullptr)
+      {
+        copy->Func.reset(new Lambda { node.Func->Params, Clone(*node.Func->Body) });
+      }
+
+      return copy;
+    }
+  }
+}
@@ -1,7 +1,7 @@
 #pragma once
 
 #include "Common.h"
-#include "Universal.h"
+#include "Ast.h"
 
 #include <tao/pegtl.hpp>
 
@@ -14,18 +14,34 @@ namespace Abacus
 
   struct BinaryOperator
   {
-    typedef Universal(*FuncType)(const Universal&, const Universal&);
-
     int Priority;
-    FuncType Func;
+    Ast::Operators Operator;
     position Pos;
   };
 
-  struct BinaryOperatorsStack
+  /**
+   * @brief BinaryStacks builds tree of binary operations by priorities of operators.
+   *
+   * @note Operators and operands of all parenthesis levels are kept in two flat stacks, a level
+   *       remembers where its part of the stacks begins.
+   */
+  struct BinaryStacks
   {
+    BinaryStacks()
+    {
+      Open();
+    }
+
+    void Open()
+    {
+      m_levels.push_back(Level { m_operators.size(), m_values.size() });
+    }
+
     void PushOperator(const BinaryOperator& op)
     {
-      if ((!m_operators.empty()) && (m_operators.back().Priority >=  op.Priority))
+      assert(!m_levels.empty());
+
+      if (m_operators.size() > m_levels.back().OperatorsBegin && m_operators.back().Priority >= op.Priority)
       {
         RollUp();
       }
@@ -33,114 +49,90 @@ namespace Abacus
       m_operators.push_back(op);
     }
 
-    void PushUniversal(const Universal& u)
+    void PushNode(Ast::NodePtr node)
     {
-      m_values.push_back(u);
+      assert(!m_levels.empty());
+
+      m_values.push_back(std::move(node));
     }
 
-    Universal Calculate()
+    void Close()
     {
-      // If there are operators then expected m_operators.size() + 1 values.
-      if (!m_operators.empty() && m_values.size() != m_operators.size() + 1)
-      {
-        position afterLastOperator = m_operators.back().Pos;
-        afterLastOperator.byte += 1;
-        afterLastOperator.byte_in_line += 1;
+      assert(m_levels.size() > 1);
 
-        throw parse_error("Expected expression.", afterLastOperator);
-      }
+      Ast::NodePtr node = BuildLevel();
 
-      while (!m_operators.empty())
-      {
-        RollUp();
-      }
+      m_values.push_back(std::move(node));
+    }
 
-      Universal result = m_values.front();
+    Ast::NodePtr Build()
+    {
+      assert(m_levels.size() == 1U);
 
-      return result;
+      return BuildLevel();
     }
 
   private:
 
-    void RollUp()
+    struct Level
     {
-      assert(m_values.size() > 1U);
-      assert(m_values.size() > m_operators.size());
-      assert(m_values.size() - m_operators.size() ==  1U);
+      size_t OperatorsBegin;
+      size_t ValuesBegin;
+    };
 
-      Universal right = m_values.back();
-      m_values.pop_back();
-
-      Universal left = m_values.back();
-      m_values.pop_back();
-
-      BinaryOperator op = m_operators.back();
-      m_operators.pop_back();
+    Ast::NodePtr BuildLevel()
+    {
+      const Level level = m_levels.back();
+      m_levels.pop_back();
 
-      m_values.reserve(m_values.size() + 1U);
+      const size_t operatorsNumber = m_operators.size() - level.OperatorsBegin;
+      const size_t valuesNumber = m_values.size() - level.ValuesBegin;
 
-      try
+      // If there are operators then expected operatorsNumber + 1 values.
+      if (operatorsNumber != 0U && valuesNumber != operatorsNumber + 1U)
       {
-        Universal result = op.Func(left, right);
-        m_values.push_back(result);
+        position afterLastOperator = m_operators.back().Pos;
+        afterLastOperator.byte += 1;
+        afterLastOperator.byte_in_line += 1;
+
+        throw parse_error("Expected expression.", afterLastOperator);
       }
-      catch (const std::exception& err)
+
+      while (m_operators.size() > level.OperatorsBegin)
       {
-        throw parse_error(err.what(), op.Pos);
+        RollUp();
       }
-    }
-
-    std::vector<BinaryOperator> m_operators;
-    std::vector<Universal> m_values;
-  };
-
-  struct BinaryStacks
-  {
-    BinaryStacks()
-    {
-      Open();
-    }
-
-    void Open()
-    {
-      m_stacks.push_back(BinaryOperatorsStack());
-    }
 
-    void PushOperator(const BinaryOperator& op)
-    {
-      assert(!m_stacks.empty());
+      Ast::NodePtr result = std::move(m_values[level.ValuesBegin]);
+      m_values.resize(level.ValuesBegin);
 
-      m_stacks.back().PushOperator(op);
+      return result;
     }
 
-    void PushUniversal(const Universal& u)
+    void RollUp()
     {
-      assert(!m_stacks.empty());
-
-      m_stacks.back().PushUniversal(u);
-    }
+      assert(m_values.size() > 1U);
 
-    void Close()
-    {
-      assert(m_stacks.size() > 1);
+      Ast::NodePtr right = std::move(m_values.back());
+      m_values.pop_back();
 
-      Universal u = m_stacks.back().Calculate();
-      m_stacks.pop_back();
+      Ast::NodePtr left = std::move(m_values.back());
+      m_values.pop_back();
 
-      m_stacks.back().PushUniversal(u);
-    }
+      const BinaryOperator& op = m_operators.back();
 
-    Universal Calculate()
-    {
-      assert(m_stacks.size() == 1U);
+      Ast::NodePtr node = Ast::MakeNode(Ast::Node::Kinds::BINARY_OP, op.Pos);
+      node->Operator = op.Operator;
+      node->Args.push_back(std::move(left));
+      node->Args.push_back(std::move(right));
 
-      Universal result = m_stacks.back().Calculate();
-      m_stacks.pop_back();
+      m_operators.pop_back();
 
-      return result;
+      m_values.push_back(std::move(node));
     }
 
-  private:
-    std::vector<BinaryOperatorsStack> m_stacks;
+    std::vector<Level> m_levels;
+    std::vector<BinaryOperator> m_operators;
+    std::vector<Ast::NodePtr> m_values;
   };
 }
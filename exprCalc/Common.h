@@ -3,8 +3,10 @@
 #include "ExprCalc.h"
 #include "Universal.h"
 
+#include <algorithm>
 #include <cstdio>
 #include <string>
+#include <thread>
 #include <vector>
 #include <typeinfo>
 
@@ -26,6 +28,47 @@ namespace Abacus
 
   struct TerminatedError { };
 
+  /** @brief Returns true if termination of the calculation was requested. */
+  inline bool IsCancelled(const ExecControl* control)
+  {
+    return control != nullptr && control->IsCancelled();
+  }
+
+  /** @brief Adds items of a started operation to the progress of the calculation. */
+  inline void ReportStarted(ExecControl* control, const size_t items)
+  {
+    if (control != nullptr)
+    {
+      control->AddTotal(items);
+    }
+  }
+
+  /** @brief Adds calculated items to the progress of the calculation. */
+  inline void ReportDone(ExecControl* control, const size_t items)
+  {
+    if (control != nullptr)
+    {
+      control->AddDone(items);
+    }
+  }
+
+  /** @brief Maximal length of a stored sequence. Ranges are not stored, so they are not limited. */
+  static const size_t MAX_SEQUENCE_SIZE = 2000000U;
+
+  /**
+   * @brief Returns number of items per job of an operation over a sequence of the given size.
+   *
+   * @note Jobs have at least the grain size items, so a short sequence is split into fewer jobs than threads.
+   *       A sequence is calculated by one job if it is run serially.
+   */
+  inline size_t GetJobSize(const ExecOptions& options, const size_t size)
+  {
+    const unsigned hardwareThreads = std::max(std::thread::hardware_concurrency(), 1U);
+    const unsigned threads = options.IsSerial ? 1U : options.Threads != 0U ? options.Threads : hardwareThreads;
+
+    return std::max(size / threads + 1U, options.GrainSize);
+  }
+
   template< char C, typename Input >
   void ExpectChar(Input& input)
   {
@@ -97,13 +140,13 @@ namespace Abacus
   const T& GetValue(const Universal& u)
   {
     static_assert(
-          std::is_same<T, int>::value ||
+          std::is_same<T, Universal::Int>::value ||
           std::is_same<T, double>::value ||
           std::is_same<T, Universal::IntArray>::value ||
           std::is_same<T, Universal::RealArray>::value,
           "Invalid data type.");
 
-    if (std::is_same<T, int>::value && Universal::Types::INTEGER == u.Type)
+    if (std::is_same<T, Universal::Int>::value && Universal::Types::INTEGER == u.Type)
     {
       return u.Integer;
     }
@@ -113,11 +156,11 @@ namespace Abacus
     }
     else if (std::is_same<T, Universal::IntArray>::value && Universal::Types::INT_SEQUENCE == u.Type)
     {
-      return u.IntSequence;
+      return u.IntSequence.Items();
     }
     else if (std::is_same<T, Universal::RealArray>::value && Universal::Types::REAL_SEQUENCE == u.Type)
     {
-      return u.RealSequence;
+      return u.RealSequence.Items();
     }
 
     throw parse_error(
@@ -130,11 +173,11 @@ namespace Abacus
   T GetNumber(const Universal& u)
   {
     static_assert(
-          std::is_same<T, int>::value ||
+          std::is_same<T, Universal::Int>::value ||
           std::is_same<T, double>::value,
           "Invalid data type.");
 
-    if (std::is_same<T, int>::value && Universal::Types::INTEGER == u.Type)
+    if (std::is_same<T, Universal::Int>::value && Universal::Types::INTEGER == u.Type)
     {
       return u.Integer;
     }
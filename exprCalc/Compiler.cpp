@@ -0,0 +1,667 @@
+#include "Compiler.h"
+
+#include "Common.h"
+
+#include <tao/pegtl.hpp>
+
+#include <map>
+#include <tuple>
+#include <limits>
+#include <cstring>
+#include <algorithm>
+
+namespace Abacus
+{
+  namespace Compiler
+  {
+    using tao::TAOCPP_PEGTL_NAMESPACE::parse_error;
+
+    static const unsigned MAX_REGISTERS_NUMBER = std::numeric_limits<unsigned short>::max();
+
+    static bool IsSameConstant(const Universal& l, const Universal& r)
+    {
+      // Compare reals bitwise to keep 0.0 and -0.0 different.
+      if (l.Type == Universal::Types::REAL && r.Type == Universal::Types::REAL)
+      {
+        return std::memcmp(&l.Real, &r.Real, sizeof(l.Real)) == 0;
+      }
+
+      return l == r;
+    }
+
+    static bool IsNumberType(const Universal::Types type)
+    {
+      return type == Universal::Types::INTEGER || type == Universal::Types::REAL;
+    }
+
+    /** @brief Indexes of compiled lambda variants by lambda and types of its parameters. */
+    typedef std::map<std::tuple<const Ast::Lambda*, Universal::Types, Universal::Types>, unsigned> Variants;
+
+    class FunctionCompiler
+    {
+    public:
+      FunctionCompiler(Vm::Module& module,
+                       Variants& variants,
+                       std::vector<std::string>& variables,
+                       const std::vector<std::string>& parameters,
+                       const std::vector<Universal::Types>& parameterTypes)
+        : m_module(module),
+          m_variants(variants),
+          m_variables(variables),
+          m_parameterTypes(parameterTypes),
+          m_nextRegister(0U)
+      {
+        m_function.Parameters = parameters;
+        m_function.Entry = 0U;
+        m_function.RegistersNumber = 0U;
+        m_function.ResultType = Universal::Types::INVALID;
+      }
+
+      Vm::Function Compile(const Ast::Node& body)
+      {
+        m_function.ResultType = InferTypes(body);
+
+        CollectConstants(body);
+
+        m_nextRegister = static_cast<unsigned>(m_function.Parameters.size() + m_function.Constants.size());
+        if (m_nextRegister >= MAX_REGISTERS_NUMBER)
+        {
+          throw parse_error("Expression is too complex.", body.Pos);
+        }
+
+        m_function.RegistersNumber = m_nextRegister;
+
+        // Lambdas are called for every item of a sequence, so parts which do not depend on
+        // parameters are moved to the prologue.
+        if (!m_function.Parameters.empty())
+        {
+          HoistInvariants(body);
+
+          if (!m_function.Code.empty())
+          {
+            Emit(Vm::OpCode::RETURN, body, m_nextRegister - 1U);
+            m_function.Entry = m_function.Code.size();
+          }
+        }
+
+        const unsigned result = CompileNode(body);
+        Emit(Vm::OpCode::RETURN, body, result);
+
+        return std::move(m_function);
+      }
+
+    private:
+
+      /** @brief Returns true if operation is calculated on reals. */
+      bool IsRealOperation(const Ast::Node& node) const
+      {
+        const Universal::Types left = m_types.at(node.Args[0].get());
+        const Universal::Types right = m_types.at(node.Args[1].get());
+
+        return IsNumberType(left) &&
+            IsNumberType(right) &&
+            m_types.at(&node) == Universal::Types::REAL;
+      }
+
+      /**
+       * @brief Infers types of the node and its subtrees. Lambda variants which can be called by
+       *        the node are compiled.
+       *
+       * @return Type of the node value. It is INVALID if the type is unknown at compile time.
+       */
+      Universal::Types InferTypes(const Ast::Node& node)
+      {
+        for (const auto& arg : node.Args)
+        {
+          InferTypes(*arg);
+        }
+
+        Universal::Types type = Universal::Types::INVALID;
+
+        switch (node.Kind)
+        {
+          case Ast::Node::Kinds::CONSTANT:
+            type = node.Value.Type;
+            break;
+
+          case Ast::Node::Kinds::PARAMETER:
+            type = m_parameterTypes[node.Slot];
+            break;
+
+          case Ast::Node::Kinds::VARIABLE:
+            // Values of variables are known at run time only.
+            break;
+
+          case Ast::Node::Kinds::BINARY_OP:
+            type = BinaryOpType(node.Operator,
+                                m_types.at(node.Args[0].get()),
+                                m_types.at(node.Args[1].get()));
+            break;
+
+          case Ast::Node::Kinds::SEQUENCE:
+            type = Universal::Types::INT_SEQUENCE;
+            break;
+
+          case Ast::Node::Kinds::MAP:
+            type = InferMapTypes(node);
+            break;
+
+          case Ast::Node::Kinds::REDUCE:
+            type = InferReduceTypes(node);
+            break;
+        }
+
+        m_types[&node] = type;
+
+        return type;
+      }
+
+      static Universal::Types BinaryOpType(const Ast::Operators op,
+                                           const Universal::Types left,
+                                           const Universal::Types right)
+      {
+        // Division and power always return reals.
+        if (op == Ast::Operators::DIV || op == Ast::Operators::POW)
+        {
+          return Universal::Types::REAL;
+        }
+
+        if (!IsNumberType(left) || !IsNumberType(right))
+        {
+          return Universal::Types::INVALID;
+        }
+
+        return left == Universal::Types::INTEGER && right == Universal::Types::INTEGER ?
+              Universal::Types::INTEGER : Universal::Types::REAL;
+      }
+
+      /** @brief Returns types of sequence items. Unknown sequence may contain items of any type. */
+      static std::vector<Universal::Types> ItemTypes(const Universal::Types sequence)
+      {
+        switch (sequence)
+        {
+          case Universal::Types::INT_SEQUENCE:
+            return { Universal::Types::INTEGER };
+          case Universal::Types::REAL_SEQUENCE:
+            return { Universal::Types::REAL };
+          case Universal::Types::INVALID:
+            return { Universal::Types::INTEGER, Universal::Types::REAL };
+          default:
+            // map() and reduce() fail for values which are not sequences.
+            return { };
+        }
+      }
+
+      Universal::Types InferMapTypes(const Ast::Node& node)
+      {
+        const unsigned lambda = AddLambda(node);
+
+        Universal::Types resultType = Universal::Types::INVALID;
+        bool isFirstVariant = true;
+
+        for (const Universal::Types itemType : ItemTypes(m_types.at(node.Args[0].get())))
+        {
+          const unsigned idx = CompileVariant(*node.Func, { itemType });
+          m_module.Lambdas[lambda].Variants[itemType == Universal::Types::REAL][0] = static_cast<unsigned short>(idx);
+
+          const Universal::Types variantType = m_module.Functions[idx].ResultType;
+          resultType = isFirstVariant || resultType == variantType ? variantType : Universal::Types::INVALID;
+          isFirstVariant = false;
+        }
+
+        switch (resultType)
+        {
+          case Universal::Types::INTEGER:
+            return Universal::Types::INT_SEQUENCE;
+          case Universal::Types::REAL:
+            return Universal::Types::REAL_SEQUENCE;
+          default:
+            return Universal::Types::INVALID;
+        }
+      }
+
+      static void AddType(std::vector<Universal::Types>& types, const Universal::Types type)
+      {
+        if (std::find(types.cbegin(), types.cend(), type) == types.cend())
+        {
+          types.push_back(type);
+        }
+      }
+
+      Universal::Types InferReduceTypes(const Ast::Node& node)
+      {
+        const unsigned lambda = AddLambda(node);
+
+        // Accumulator starts from the neutral value, then it takes values returned by lambda.
+        // Partial results of parallel jobs are passed to lambda as items.
+        std::vector<Universal::Types> itemTypes = ItemTypes(m_types.at(node.Args[0].get()));
+        std::vector<Universal::Types> accumulatorTypes;
+        std::vector<Universal::Types> resultTypes;
+
+        const Universal::Types neutralType = m_types.at(node.Args[1].get());
+        if (IsNumberType(neutralType))
+        {
+          accumulatorTypes.push_back(neutralType);
+        }
+        else if (neutralType == Universal::Types::INVALID)
+        {
+          accumulatorTypes = { Universal::Types::INTEGER, Universal::Types::REAL };
+        }
+
+        if (itemTypes.empty())
+        {
+          return Universal::Types::INVALID;
+        }
+
+        static const Universal::Types NUMBER_TYPES[] = { Universal::Types::INTEGER, Universal::Types::REAL };
+
+        const auto hasType = [](const std::vector<Universal::Types>& types, const Universal::Types type)
+        {
+          return std::find(types.cbegin(), types.cend(), type) != types.cend();
+        };
+
+        // Variants are compiled until types of parameters and results do not change. Types are taken
+        // from a fixed list, so the sets can grow while they are checked.
+        bool isChanged = true;
+        while (isChanged)
+        {
+          isChanged = false;
+
+          for (const Universal::Types accumulatorType : NUMBER_TYPES)
+          {
+            for (const Universal::Types itemType : NUMBER_TYPES)
+            {
+              if (!hasType(accumulatorTypes, accumulatorType) || !hasType(itemTypes, itemType))
+              {
+                continue;
+              }
+
+              const unsigned short variant = m_module.Lambdas[lambda].Variants
+                  [accumulatorType == Universal::Types::REAL][itemType == Universal::Types::REAL];
+              if (variant != 0U)
+              {
+                continue;
+              }
+
+              const unsigned idx = CompileVariant(*node.Func, { accumulatorType, itemType });
+              m_module.Lambdas[lambda].Variants
+                  [accumulatorType == Universal::Types::REAL][itemType == Universal::Types::REAL] =
+                  static_cast<unsigned short>(idx);
+              isChanged = true;
+
+              // Lambda fails if it returns not a number. Unknown result may be of any number type.
+              const Universal::Types resultType = m_module.Functions[idx].ResultType;
+
+              for (const Universal::Types type : NUMBER_TYPES)
+              {
+                if (type == resultType || resultType == Universal::Types::INVALID)
+                {
+                  AddType(resultTypes, type);
+                  AddType(accumulatorTypes, type);
+                  AddType(itemTypes, type);
+                }
+              }
+            }
+          }
+        }
+
+        return resultTypes.size() == 1U ? resultTypes.front() : Universal::Types::INVALID;
+      }
+
+      unsigned AddLambda(const Ast::Node& node)
+      {
+        const unsigned lambda = static_cast<unsigned>(m_module.Lambdas.size());
+        if (lambda >= MAX_REGISTERS_NUMBER)
+        {
+          throw parse_error("Expression is too complex.", node.Pos);
+        }
+
+        m_lambdas[&node] = lambda;
+        m_module.Lambdas.push_back(Vm::Lambda { { { 0U, 0U }, { 0U, 0U } } });
+
+        return lambda;
+      }
+
+      unsigned CompileVariant(const Ast::Lambda& lambda, const std::vector<Universal::Types>& parameterTypes)
+      {
+        const auto key = std::make_tuple(&lambda,
+                                         parameterTypes.front(),
+                                         parameterTypes.size() > 1U ? parameterTypes[1] : Universal::Types::INVALID);
+
+        const auto it = m_variants.find(key);
+        if (it != m_variants.cend())
+        {
+          return it->second;
+        }
+
+        // Reserve index of the variant before compiling nested lambdas.
+        const size_t idx = m_module.Functions.size();
+        if (idx >= MAX_REGISTERS_NUMBER)
+        {
+          throw parse_error("Expression is too complex.", lambda.Body->Pos);
+        }
+
+        m_module.Functions.emplace_back();
+        m_variants[key] = static_cast<unsigned>(idx);
+
+        FunctionCompiler compiler(m_module, m_variants, m_variables, lambda.Params.Parameters, parameterTypes);
+        Vm::Function function = compiler.Compile(*lambda.Body);
+
+        m_module.Functions[idx] = std::move(function);
+
+        return static_cast<unsigned>(idx);
+      }
+
+      void AddConstant(const Universal& value)
+      {
+        const auto it = std::find_if(m_function.Constants.cbegin(),
+                                     m_function.Constants.cend(),
+                                     [&value](const Universal& c) { return IsSameConstant(c, value); });
+        if (it == m_function.Constants.cend())
+        {
+          m_function.Constants.push_back(value);
+        }
+      }
+
+      void CollectConstants(const Ast::Node& node)
+      {
+        if (node.Kind == Ast::Node::Kinds::CONSTANT)
+        {
+          AddConstant(node.Value);
+        }
+        else if (node.Kind == Ast::Node::Kinds::BINARY_OP && IsRealOperation(node))
+        {
+          // Integer constants are converted at compile time.
+          for (const auto& arg : node.Args)
+          {
+            if (arg->Kind == Ast::Node::Kinds::CONSTANT && arg->Value.Type == Universal::Types::INTEGER)
+            {
+              AddConstant(Universal(static_cast<double>(arg->Value.Integer)));
+            }
+          }
+        }
+
+        // Constants of lambdas are collected by their own compilers.
+        for (const auto& arg : node.Args)
+        {
+          CollectConstants(*arg);
+        }
+      }
+
+      static bool IsInvariant(const Ast::Node& node)
+      {
+        if (node.Kind == Ast::Node::Kinds::PARAMETER)
+        {
+          return false;
+        }
+
+        // Nested lambdas have no closure, so only arguments are checked.
+        return std::all_of(node.Args.cbegin(),
+                           node.Args.cend(),
+                           [](const Ast::NodePtr& arg) { return IsInvariant(*arg); });
+      }
+
+      void HoistInvariants(const Ast::Node& node)
+      {
+        if (!IsInvariant(node))
+        {
+          for (const auto& arg : node.Args)
+          {
+            HoistInvariants(*arg);
+          }
+        }
+        else if (node.Kind != Ast::Node::Kinds::CONSTANT)
+        {
+          // The result register is kept until the end of the function.
+          const unsigned result = CompileNode(node);
+          m_nextRegister = result + 1U;
+          m_hoisted[&node] = result;
+        }
+      }
+
+      unsigned ConstantRegister(const Universal& value) const
+      {
+        const auto it = std::find_if(m_function.Constants.cbegin(),
+                                     m_function.Constants.cend(),
+                                     [&value](const Universal& c) { return IsSameConstant(c, value); });
+
+        return static_cast<unsigned>(m_function.Parameters.size() + (it - m_function.Constants.cbegin()));
+      }
+
+      unsigned VariableSlot(const Ast::Node& node)
+      {
+        const auto it = std::find(m_variables.cbegin(), m_variables.cend(), node.Name);
+        if (it != m_variables.cend())
+        {
+          return static_cast<unsigned>(it - m_variables.cbegin());
+        }
+
+        if (m_variables.size() >= MAX_REGISTERS_NUMBER)
+        {
+          throw parse_error("Expression is too complex.", node.Pos);
+        }
+
+        m_variables.push_back(node.Name);
+
+        return static_cast<unsigned>(m_variables.size() - 1U);
+      }
+
+      unsigned AllocateRegister(const Ast::Node& node)
+      {
+        if (m_nextRegister >= MAX_REGISTERS_NUMBER)
+        {
+          throw parse_error("Expression is too complex.", node.Pos);
+        }
+
+        const unsigned reg = m_nextRegister++;
+        m_function.RegistersNumber = std::max(m_function.RegistersNumber, m_nextRegister);
+
+        return reg;
+      }
+
+      /** @brief Compiles the node and converts its value to real if it is integer. */
+      unsigned CompileReal(const Ast::Node& node)
+      {
+        if (m_types.at(&node) == Universal::Types::REAL)
+        {
+          return CompileNode(node);
+        }
+
+        if (node.Kind == Ast::Node::Kinds::CONSTANT)
+        {
+          return ConstantRegister(Universal(static_cast<double>(node.Value.Integer)));
+        }
+
+        const unsigned value = CompileNode(node);
+        const unsigned result = AllocateRegister(node);
+        Emit(Vm::OpCode::TO_REAL, node, result, value);
+        return result;
+      }
+
+      void Emit(Vm::OpCode op,
+                const Ast::Node& node,
+                unsigned a,
+                unsigned b = 0U,
+                unsigned c = 0U,
+                unsigned d = 0U,
+                unsigned e = 0U)
+      {
+        m_function.Code.push_back(Vm::Instruction {
+                                    op,
+                                    static_cast<unsigned short>(a),
+                                    static_cast<unsigned short>(b),
+                                    static_cast<unsigned short>(c),
+                                    static_cast<unsigned short>(d),
+                                    static_cast<unsigned short>(e) });
+        m_function.Nodes.push_back(&node);
+      }
+
+      unsigned CompileNode(const Ast::Node& node)
+      {
+        // Temporary registers of arguments are released once the instruction is emitted,
+        // so the result register can be the same as a register of an argument.
+        const unsigned firstFreeRegister = m_nextRegister;
+
+        const auto hoisted = m_hoisted.find(&node);
+        if (hoisted != m_hoisted.cend())
+        {
+          return hoisted->second;
+        }
+
+        switch (node.Kind)
+        {
+          case Ast::Node::Kinds::CONSTANT:
+            return ConstantRegister(node.Value);
+
+          case Ast::Node::Kinds::PARAMETER:
+            return node.Slot;
+
+          case Ast::Node::Kinds::VARIABLE:
+          {
+            const unsigned variable = VariableSlot(node);
+            const unsigned result = AllocateRegister(node);
+            Emit(Vm::OpCode::LOAD_VARIABLE, node, result, variable);
+            return result;
+          }
+
+          case Ast::Node::Kinds::BINARY_OP:
+          {
+            static const Vm::OpCode OPERATOR_CODES[] =
+            {
+              Vm::OpCode::ADD,
+              Vm::OpCode::SUB,
+              Vm::OpCode::MUL,
+              Vm::OpCode::DIV,
+              Vm::OpCode::POW
+            };
+
+            static const Vm::OpCode INTEGER_OPERATOR_CODES[] =
+            {
+              Vm::OpCode::ADD_INTEGER,
+              Vm::OpCode::SUB_INTEGER,
+              Vm::OpCode::MUL_INTEGER
+            };
+
+            static const Vm::OpCode REAL_OPERATOR_CODES[] =
+            {
+              Vm::OpCode::ADD_REAL,
+              Vm::OpCode::SUB_REAL,
+              Vm::OpCode::MUL_REAL,
+              Vm::OpCode::DIV_REAL,
+              Vm::OpCode::POW_REAL
+            };
+
+            Vm::OpCode op = OPERATOR_CODES[static_cast<unsigned>(node.Operator)];
+            unsigned left = 0U;
+            unsigned right = 0U;
+
+            if (IsRealOperation(node))
+            {
+              op = REAL_OPERATOR_CODES[static_cast<unsigned>(node.Operator)];
+              left = CompileReal(*node.Args[0]);
+              right = CompileReal(*node.Args[1]);
+            }
+            else
+            {
+              if (m_types.at(&node) == Universal::Types::INTEGER)
+              {
+                op = INTEGER_OPERATOR_CODES[static_cast<unsigned>(node.Operator)];
+              }
+
+              left = CompileNode(*node.Args[0]);
+              right = CompileNode(*node.Args[1]);
+            }
+
+            m_nextRegister = firstFreeRegister;
+            const unsigned result = AllocateRegister(node);
+            Emit(op, node, result, left, right);
+            return result;
+          }
+
+          case Ast::Node::Kinds::SEQUENCE:
+          {
+            const unsigned first = CompileNode(*node.Args[0]);
+            const unsigned last = CompileNode(*node.Args[1]);
+
+            m_nextRegister = firstFreeRegister;
+            const unsigned result = AllocateRegister(node);
+            Emit(Vm::OpCode::SEQUENCE, node, result, first, last);
+            return result;
+          }
+
+          case Ast::Node::Kinds::MAP:
+          {
+            const unsigned sequence = CompileNode(*node.Args[0]);
+            const unsigned lambda = m_lambdas.at(&node);
+
+            m_nextRegister = firstFreeRegister;
+            const unsigned result = AllocateRegister(node);
+            Emit(Vm::OpCode::MAP, node, result, sequence, lambda);
+            return result;
+          }
+
+          case Ast::Node::Kinds::REDUCE:
+          {
+            const Ast::Node& input = *node.Args[0];
+
+            // Items of map() are reduced as soon as they are calculated, so map() output is not stored.
+            if (input.Kind == Ast::Node::Kinds::MAP && m_hoisted.find(&input) == m_hoisted.cend())
+            {
+              const unsigned sequence = CompileNode(*input.Args[0]);
+              const unsigned neutral = CompileNode(*node.Args[1]);
+
+              m_nextRegister = firstFreeRegister;
+              const unsigned result = AllocateRegister(node);
+              Emit(Vm::OpCode::MAP_REDUCE, node, result, sequence, neutral, m_lambdas.at(&node), m_lambdas.at(&input));
+              return result;
+            }
+
+            const unsigned sequence = CompileNode(*node.Args[0]);
+            const unsigned neutral = CompileNode(*node.Args[1]);
+            const unsigned lambda = m_lambdas.at(&node);
+
+            m_nextRegister = firstFreeRegister;
+            const unsigned result = AllocateRegister(node);
+            Emit(Vm::OpCode::REDUCE, node, result, sequence, neutral, lambda);
+            return result;
+          }
+        }
+
+        throw parse_error(Print("Internal error: invalid node kind %u.",
+                                static_cast<unsigned>(node.Kind)),
+                          node.Pos);
+      }
+
+      Vm::Module& m_module;
+      Variants& m_variants;
+      std::vector<std::string>& m_variables;
+      const std::vector<Universal::Types> m_parameterTypes;
+      Vm::Function m_function;
+      unsigned m_nextRegister;
+
+      /** @brief Types of values of nodes. */
+      std::map<const Ast::Node*, Universal::Types> m_types;
+
+      /** @brief Indexes of module lambdas of map() and reduce() nodes. */
+      std::map<const Ast::Node*, unsigned> m_lambdas;
+
+      /** @brief Registers of subtrees calculated by the prologue. */
+      std::map<const Ast::Node*, unsigned> m_hoisted;
+    };
+
+    Vm::Module Compile(Ast::NodePtr tree, std::vector<std::string>& variables)
+    {
+      Vm::Module module;
+      module.Functions.emplace_back();
+
+      Variants variants;
+      FunctionCompiler compiler(module, variants, variables, { }, { });
+      Vm::Function function = compiler.Compile(*tree);
+
+      module.Functions.front() = std::move(function);
+      module.Tree = std::move(tree);
+
+      return module;
+    }
+  }
+}
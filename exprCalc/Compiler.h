@@ -0,0 +1,25 @@
+#pragma once
+
+#include "Ast.h"
+#include "Vm.h"
+
+#include <string>
+#include <vector>
+
+namespace Abacus
+{
+  namespace Compiler
+  {
+    /**
+     * @brief Compiles expression tree to bytecode.
+     *
+     * @param variables Names of variables by slots. Variables of the expression which are not
+     *        there yet are added.
+     *
+     * @note Module takes ownership of the tree because instructions refer to its nodes.
+     *
+     * @throw parse_error if expression is too complex to be compiled.
+     */
+    Vm::Module Compile(Ast::NodePtr tree, std::vector<std::string>& variables);
+  }
+}
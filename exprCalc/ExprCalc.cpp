@@ -1,21 +1,84 @@
 #include "ExprCalc.h"
 
+#include "Vm.h"
+#include "Compiler.h"
+#include "Optimizer.h"
 #include "ExprParse.h"
 #include "StmtParse.h"
+#include "ThreadPool.h"
 
 #include <tao/pegtl.hpp>
 #include <tao/pegtl/analyze.hpp> // Include the analyze function that checks a grammar for possible infinite cycles.
 
+#include <algorithm>
+#include <atomic>
+#include <cstdlib>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <future>
 #include <iterator>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <utility>
 
 namespace Abacus
 {
   using namespace tao::TAOCPP_PEGTL_NAMESPACE;
 
-  // Simplification: expected 4-core systems. 1 core for GUI and 3 for background tasks.
-  unsigned WORK_THREADS_NUM = 3U;
+  /** @brief Returns value of the environment variable if it is a non-negative integer, otherwise defaultValue. */
+  static size_t GetEnvNumber(const char* name, const size_t defaultValue)
+  {
+    const char* const value = std::getenv(name);
+    if (value == nullptr || *value == '\0')
+    {
+      return defaultValue;
+    }
+
+    char* end = nullptr;
+    const unsigned long long number = std::strtoull(value, &end, 10);
+
+    return *end == '\0' && *value != '-' ? static_cast<size_t>(number) : defaultValue;
+  }
+
+  const ExecOptions& DefaultExecOptions()
+  {
+    static const size_t DEFAULT_GRAIN_SIZE = 256U;
+
+    static const ExecOptions options
+    {
+      static_cast<unsigned>(GetEnvNumber("ABACUS_THREADS", std::thread::hardware_concurrency())),
+      GetEnvNumber("ABACUS_GRAIN_SIZE", DEFAULT_GRAIN_SIZE),
+      GetEnvNumber("ABACUS_SERIAL", 0U) != 0U,
+      GetEnvNumber("ABACUS_DETERMINISTIC", 0U) != 0U
+    };
+
+    return options;
+  }
+
+  /** @brief Returns values of variables by slots. Slots of undefined variables are nullptr. */
+  static std::vector<const Universal*> ResolveVariables(const std::vector<std::string>& names,
+                                                        const State& variables)
+  {
+    std::vector<const Universal*> slots(names.size(), nullptr);
+
+    for (size_t slot = 0; slot < names.size(); ++slot)
+    {
+      const auto it = variables.find(names[slot]);
+      if (it != variables.cend())
+      {
+        slots[slot] = &it->second;
+      }
+    }
 
-  Universal Calculate(const std::string& expression, const State& variables, IsTerminating isTerminating)
+    return slots;
+  }
+
+  Universal Calculate(const std::string& expression,
+                      const State& variables,
+                      ExecControl* control,
+                      const ExecOptions& options)
   {
     Universal result; // result is initialized as invalid value.
 
@@ -23,7 +86,17 @@ namespace Abacus
     {
       memory_input<> input(expression.data(), expression.size(), "Calculate");
 
-      Expr::Expect(input, isTerminating, WORK_THREADS_NUM, variables, result);
+      Ast::NodePtr tree;
+      Expr::Expect(input, Ast::Scope { true, { } }, tree);
+
+      std::vector<std::string> names;
+      const Vm::Module module = Compiler::Compile(Optimizer::Optimize(std::move(tree), variables), names);
+
+      const std::vector<const Universal*> slots = ResolveVariables(names, variables);
+      const Vm::Context context { control, options, &slots };
+      Universal value = Vm::Calculate(module, context);
+      Sequence::CheckResult(value, module.Tree->Pos);
+      result = Sequence::Store(value, control, options);
 
       return result;
     }
@@ -34,42 +107,407 @@ namespace Abacus
       std::cout << "Failed to interpret expression. Reason: " << err.what() <<
                    ", pos: " << positionStr << std::endl;
     }
+    catch (const TerminatedError&)
+    {
+      // The result is invalid if the calculation was terminated.
+    }
 
     return result;
   }
 
-  ExecResult Execute(const std::string& statement, const State& variables, IsTerminating isTerminating)
+  static Error MakeError(const parse_error& err)
   {
-    ExecResult execResult = { ResultBrief::FAILED, {}, {}, {} };
-    State currentVariables = variables;
-    memory_input<> input(statement.data(), statement.size(), "Execute");
+    std::vector<Abacus::Position> errorPositions;
+    errorPositions.reserve(err.positions.size());
+    for (const auto& pos : err.positions)
+    {
+      errorPositions.push_back(Abacus::Position { pos.byte } );
+    }
 
-    try
+    return Error { err.what(), std::move(errorPositions) };
+  }
+
+  struct Program::Impl
+  {
+    std::vector<Stmt::Statement> Statements;
+    std::vector<Error> Errors;
+
+    /** @brief Names of variables by slots. */
+    std::vector<std::string> Variables;
+
+    /** @brief Statements which read values of a statement, by statements. */
+    std::vector<std::vector<size_t>> Dependents;
+
+    /** @brief Statements are run concurrently if several of them have map() or reduce(). Others are cheap to run in order. */
+    bool IsConcurrent;
+  };
+
+  /** @brief Result of a statement of a running program. */
+  struct StatementRun
+  {
+    /** @param control Control of the program. */
+    explicit StatementRun(ExecControl* control)
+      : Control(control),
+        IsFinished(false),
+        Pending(0U)
     {
-        parse<star<space>>(input);
+    }
+
+    /** @brief Control of the statement. It is cancelled if a preceding statement failed. */
+    ExecControl Control;
+
+    Universal Value;
+    std::string Output;
+
+    /** @brief Exception thrown by the statement. */
+    std::exception_ptr Error;
 
-        while (!input.empty())
+    /** @brief The statement is finished or skipped. It is changed under the output mutex. */
+    bool IsFinished;
+
+    /** @brief Number of statements which should finish before the statement is started. */
+    std::atomic<size_t> Pending;
+  };
+
+  /** @brief Returns values of variables by slots for the statement. Values assigned by the program are taken from runs. */
+  static std::vector<const Universal*> GetVariables(const Stmt::Statement& statement,
+                                                    const std::vector<const Universal*>& slots,
+                                                    const std::deque<StatementRun>& runs)
+  {
+    std::vector<const Universal*> variables(slots);
+    for (const auto& input : statement.Inputs)
+    {
+      variables[input.Slot] = &runs[input.Statement].Value;
+    }
+
+    return variables;
+  }
+
+  static bool IsOutput(const Stmt::Statement& statement)
+  {
+    return statement.Kind == Stmt::Statement::Kinds::PRINT_EXPR || statement.Kind == Stmt::Statement::Kinds::PRINT_TEXT;
+  }
+
+  /** @brief OutputError is thrown by a statement whose output was rejected by the output handler. */
+  struct OutputError
+  {
+    std::string Message;
+  };
+
+  /**
+   * @brief Runs statements. Independent statements are run concurrently by the pool.
+   *
+   * A statement is started when the statements which assign its variables are finished. Statements
+   * which follow a failed statement are not started, running ones are terminated by their controls.
+   * If the output handler throws, the statement whose output it rejected fails with OutputError.
+   *
+   * @param isConcurrent Statements are run in order by the calling thread if it is false.
+   * @param onOutput Receives output of statements in their order as soon as preceding statements are finished.
+   */
+  static void RunStatements(const std::vector<Stmt::Statement>& statements,
+                            const std::vector<std::vector<size_t>>& dependents,
+                            const bool isConcurrent,
+                            const std::vector<const Universal*>& slots,
+                            const ExecOptions& options,
+                            const OutputHandler& onOutput,
+                            std::deque<StatementRun>& runs)
+  {
+    std::atomic<size_t> firstFailedIdx(statements.size());
+
+    const auto stopAfter = [&runs, &firstFailedIdx](const size_t idx)
+    {
+      size_t failedIdx = firstFailedIdx;
+      while (idx < failedIdx && !firstFailedIdx.compare_exchange_weak(failedIdx, idx))
+      {
+      }
+
+      // Following statements which have already checked the index are terminated.
+      for (size_t followingIdx = idx + 1U; followingIdx < runs.size(); ++followingIdx)
+      {
+        runs[followingIdx].Control.Cancel();
+      }
+    };
+
+    // Output is collected up to the first statement which is not finished or failed. It is passed
+    // by one thread at a time without the lock, so the handler may take long and is called in order.
+    std::mutex outputMutex;
+    size_t outputIdx = 0U;
+    std::vector<std::pair<size_t, std::string>> pendingOutput;
+    bool isPassing = false;
+
+    // Output is not passed after the handler throws. The error is reported by the statement of the rejected output.
+    std::exception_ptr outputError;
+    size_t outputErrorIdx = statements.size();
+
+    const auto passOutput = [&statements, &onOutput, &runs, &stopAfter, &outputMutex, &outputIdx,
+                             &pendingOutput, &isPassing, &outputError, &outputErrorIdx](const size_t idx)
+    {
+      if (onOutput == nullptr)
+      {
+        return;
+      }
+
+      std::unique_lock<std::mutex> lock(outputMutex);
+
+      runs[idx].IsFinished = true;
+
+      for (; outputIdx < runs.size() && runs[outputIdx].IsFinished && runs[outputIdx].Error == nullptr; ++outputIdx)
+      {
+        if (IsOutput(statements[outputIdx]))
         {
-          State newVariables;
+          pendingOutput.emplace_back(outputIdx, runs[outputIdx].Output);
+        }
+      }
+
+      // Output collected meanwhile by other threads is passed by the thread which is passing already.
+      if (isPassing)
+      {
+        return;
+      }
+
+      isPassing = true;
+
+      std::vector<std::pair<size_t, std::string>> output;
+      while (!pendingOutput.empty() && outputError == nullptr)
+      {
+        output.swap(pendingOutput);
+        pendingOutput.clear();
 
-          bool stmtParseResult = Stmt::Parse(input,
-                                             isTerminating,
-                                             WORK_THREADS_NUM,
-                                             currentVariables,
-                                             execResult.Output,
-                                             newVariables);
+        lock.unlock();
 
-          newVariables.insert(currentVariables.cbegin(), currentVariables.cend());
+        std::exception_ptr error;
+        size_t errorIdx = 0U;
 
-          currentVariables.swap(newVariables);
+        for (const auto& line : output)
+        {
+          try
+          {
+            onOutput(line.second);
+          }
+          catch (const std::exception& err)
+          {
+            error = std::make_exception_ptr(OutputError { std::string("Output handler failed. Reason: ") + err.what() });
+          }
+          catch (...)
+          {
+            error = std::make_exception_ptr(OutputError { "Output handler failed." });
+          }
 
-          if (!stmtParseResult || !parse< sor< plus<space>, eol, eolf >  > (input))
+          if (error != nullptr)
           {
-            throw parse_error("Expected 'var', 'print' or 'out'", input);
+            errorIdx = line.first;
+            stopAfter(errorIdx);
+            break;
           }
         }
 
+        lock.lock();
+
+        if (error != nullptr)
+        {
+          outputError = error;
+          outputErrorIdx = errorIdx;
+        }
+      }
+
+      isPassing = false;
+    };
+
+    const auto runStatement = [&statements, &slots, &options, &runs, &firstFailedIdx, &stopAfter](const size_t idx)
+    {
+      if (firstFailedIdx < idx)
+      {
+        return;
+      }
+
+      StatementRun& run = runs[idx];
+
+      try
+      {
+        Stmt::Run(statements[idx], &run.Control, options, GetVariables(statements[idx], slots, runs), run.Value, run.Output);
+      }
+      catch (...)
+      {
+        run.Error = std::current_exception();
+        stopAfter(idx);
+      }
+    };
+
+    // All statements are finished, so the error of the handler is assigned to its statement without the lock.
+    const auto reportOutputError = [&runs, &outputError, &outputErrorIdx]()
+    {
+      if (outputError != nullptr && runs[outputErrorIdx].Error == nullptr)
+      {
+        runs[outputErrorIdx].Error = outputError;
+      }
+    };
+
+    if (options.IsSerial || !isConcurrent)
+    {
+      for (size_t idx = 0; idx < statements.size() && idx <= firstFailedIdx; ++idx)
+      {
+        runStatement(idx);
+        passOutput(idx);
+      }
+
+      reportOutputError();
+
+      return;
+    }
+
+    for (const auto& statementDependents : dependents)
+    {
+      for (const size_t dependent : statementDependents)
+      {
+        ++runs[dependent].Pending;
+      }
+    }
+
+    ThreadPool& pool = ThreadPool::Instance();
+
+    // The promise is owned by tasks, so it is alive while the last task sets it.
+    const auto finished = std::make_shared<std::promise<void>>();
+    std::future<void> isFinished = finished->get_future();
+    std::atomic<size_t> remaining(statements.size());
+
+    std::function<void(size_t)> start;
+
+    // A task never throws: its statement is counted as finished and its dependents are released
+    // whatever happens, otherwise the caller would wait for the last statement forever.
+    const auto runTask = [&dependents, &runs, &runStatement, &passOutput, &stopAfter, &outputMutex, &remaining, &start, finished](const size_t idx)
+    {
+      try
+      {
+        runStatement(idx);
+        passOutput(idx);
+      }
+      catch (...)
+      {
+        std::lock_guard<std::mutex> lock(outputMutex);
+
+        if (runs[idx].Error == nullptr)
+        {
+          runs[idx].Error = std::current_exception();
+        }
+
+        runs[idx].IsFinished = true;
+        stopAfter(idx);
+      }
+
+      // Workers run their newest tasks first, so statements are submitted in reverse order
+      // to be started in order and to pass their output as early as possible.
+      for (auto dependent = dependents[idx].crbegin(); dependent != dependents[idx].crend(); ++dependent)
+      {
+        if (--runs[*dependent].Pending == 0U)
+        {
+          start(*dependent);
+        }
+      }
+
+      // Objects of the caller are not accessed after the last statement is finished.
+      if (--remaining == 0U)
+      {
+        finished->set_value();
+      }
+    };
+
+    start = [&pool, &runTask](const size_t idx)
+    {
+      try
+      {
+        pool.Submit([&runTask, idx]() { runTask(idx); });
+      }
+      catch (...)
+      {
+        // The statement is run by the current thread if it cannot be submitted.
+        runTask(idx);
+      }
+    };
+
+    // Counters are changed by started statements, so independent statements are found beforehand.
+    std::vector<size_t> independent;
+    for (size_t idx = 0; idx < statements.size(); ++idx)
+    {
+      if (runs[idx].Pending == 0U)
+      {
+        independent.push_back(idx);
+      }
+    }
+
+    // They are submitted in reverse order too, see above.
+    for (auto idx = independent.crbegin(); idx != independent.crend(); ++idx)
+    {
+      start(*idx);
+    }
+
+    pool.Get(isFinished);
+
+    reportOutputError();
+  }
+
+  Program::Program(std::shared_ptr<const Impl> impl)
+    : m_impl(std::move(impl))
+  {
+  }
+
+  const std::vector<Error>& Program::Errors() const
+  {
+    return m_impl->Errors;
+  }
+
+  ExecResult Program::Run(const State& variables,
+                          ExecControl* control,
+                          const ExecOptions& options,
+                          const OutputHandler& onOutput) const
+  {
+    ExecResult execResult = { ResultBrief::FAILED, {}, {}, {} };
+
+    const std::vector<Stmt::Statement>& statements = m_impl->Statements;
+
+    // Runs are not movable, so they are kept by a deque.
+    std::deque<StatementRun> runs;
+    for (size_t idx = 0; idx < statements.size(); ++idx)
+    {
+      runs.emplace_back(control);
+    }
+
+    const std::vector<const Universal*> slots = ResolveVariables(m_impl->Variables, variables);
+
+    RunStatements(statements,
+                  m_impl->Dependents,
+                  m_impl->IsConcurrent,
+                  slots,
+                  options,
+                  onOutput,
+                  runs);
+
+    // Results are collected in order of statements up to the first failed one.
+    size_t statementIdx = 0U;
+
+    try
+    {
+      for (; statementIdx < statements.size(); ++statementIdx)
+      {
+        StatementRun& run = runs[statementIdx];
+        if (run.Error != nullptr)
+        {
+          std::rethrow_exception(run.Error);
+        }
+
+        if (IsOutput(statements[statementIdx]))
+        {
+          execResult.Output.push_back(std::move(run.Output));
+        }
+      }
+
+      if (m_impl->Errors.empty())
+      {
         execResult.Brief = ResultBrief::SUCCEEDED;
+      }
+      else
+      {
+        execResult.Errors = m_impl->Errors;
+      }
     }
     catch (const TerminatedError&)
     {
@@ -78,19 +516,111 @@ namespace Abacus
     catch (const parse_error& err)
     {
       execResult.Brief = ResultBrief::FAILED;
+      execResult.Errors.push_back(MakeError(err));
+    }
+    catch (const OutputError& err)
+    {
+      execResult.Brief = ResultBrief::FAILED;
+      execResult.Errors.push_back(Error { err.Message, {} });
+    }
+
+    execResult.Variables = variables;
+    for (size_t idx = 0; idx < std::min(statementIdx, statements.size()); ++idx)
+    {
+      const Stmt::Statement& statement = statements[idx];
+      if (statement.Kind == Stmt::Statement::Kinds::ASSIGNMENT)
+      {
+        execResult.Variables[statement.Text] = std::move(runs[idx].Value);
+      }
+      else if (statement.Kind == Stmt::Statement::Kinds::FUSED_ASSIGNMENT)
+      {
+        // The value was calculated by the next statement and never stored.
+        execResult.Variables.erase(statement.Text);
+      }
+    }
+
+    return execResult;
+  }
+
+  Program Compile(const std::string& text)
+  {
+    std::shared_ptr<Program::Impl> impl = std::make_shared<Program::Impl>();
+    memory_input<> input(text.data(), text.size(), "Compile");
+    Stmt::Globals globals;
 
-      std::vector<Abacus::Position> errorPositions;
-      errorPositions.reserve(err.positions.size());
-      for (const auto& pos : err.positions)
+    try
+    {
+      parse<star<space>>(input);
+
+      while (!input.empty())
       {
-        errorPositions.push_back(Abacus::Position { pos.byte } );
+        bool stmtParseResult = Stmt::Parse(input, impl->Statements, globals);
+
+        if (!stmtParseResult || !parse< sor< plus<space>, eol, eolf >  > (input))
+        {
+          throw parse_error("Expected 'var', 'print' or 'out'", input);
+        }
       }
+    }
+    catch (const parse_error& err)
+    {
+      impl->Errors.push_back(MakeError(err));
+    }
+
+    Stmt::Fuse(impl->Statements, globals.Variables);
+    Stmt::Bind(impl->Statements, globals.Variables.size());
+
+    impl->IsConcurrent = std::count_if(impl->Statements.cbegin(),
+                                       impl->Statements.cend(),
+                                       [](const Stmt::Statement& statement) { return !statement.Module.Lambdas.empty(); }) > 1;
 
-      execResult.Errors.push_back(Error { err.what(), std::move(errorPositions) });
+    impl->Dependents.resize(impl->Statements.size());
+    for (size_t idx = 0; idx < impl->Statements.size(); ++idx)
+    {
+      std::vector<size_t> dependencies;
+      for (const auto& input : impl->Statements[idx].Inputs)
+      {
+        dependencies.push_back(input.Statement);
+      }
+
+      std::sort(dependencies.begin(), dependencies.end());
+      dependencies.erase(std::unique(dependencies.begin(), dependencies.end()), dependencies.end());
+
+      for (const size_t dependency : dependencies)
+      {
+        impl->Dependents[dependency].push_back(idx);
+      }
     }
 
-    execResult.Variables.swap(currentVariables);
+    impl->Variables = std::move(globals.Variables);
 
-    return execResult;
+    return Program(impl);
+  }
+
+  ExecResult Execute(const std::string& statement,
+                     const State& variables,
+                     ExecControl* control,
+                     const ExecOptions& options)
+  {
+    return Compile(statement).Run(variables, control, options);
+  }
+
+  ExecHandle ExecuteAsync(const std::string& statement,
+                          const State& variables,
+                          ExecControl* parentControl,
+                          OutputHandler onOutput,
+                          const ExecOptions& options)
+  {
+    ExecHandle handle;
+    handle.Control = std::make_shared<ExecControl>(parentControl);
+
+    // Arguments are copied, so they may be destroyed by the caller while the task is running.
+    handle.Result = ThreadPool::Instance().Submit(
+          [statement, variables, onOutput, options, control = handle.Control]()
+    {
+      return Compile(statement).Run(variables, control.get(), options, onOutput);
+    });
+
+    return handle;
   }
 }
@@ -3,8 +3,12 @@
 #include "Universal.h"
 
 #include <map>
+#include <atomic>
+#include <memory>
 #include <string>
 #include <vector>
+#include <cstdint>
+#include <future>
 #include <functional>
 
 /**
@@ -38,8 +42,107 @@ namespace Abacus
   /** @brief State is a set of variables in Abacus */
   typedef std::map<std::string, Universal> State;
 
-  /** @brief Function type for "Check if terminate was requested" callback */
-  typedef std::function<bool()> IsTerminating;
+  /**
+   * @brief ExecControl lets the host terminate a calculation and watch its progress from other threads.
+   *
+   * The termination flag and progress counters are atomic, so calculations check the flag for every
+   * item without locks.
+   *
+   * @note Progress is counted in items of map() and reduce() operations, including operations nested
+   *       in lambdas. Items of reduce(map(...)) are counted twice, once for each operation.
+   */
+  class ExecControl
+  {
+  public:
+    /** @param parent Control which terminates the calculation too. Progress is also added to it. */
+    explicit ExecControl(ExecControl* parent = nullptr)
+      : m_parent(parent),
+        m_isCancelled(false),
+        m_itemsDone(0U),
+        m_itemsTotal(0U)
+    {
+    }
+
+    ExecControl(const ExecControl&) = delete;
+    ExecControl& operator=(const ExecControl&) = delete;
+
+    /** @brief Requests termination of calculations which use the control. */
+    void Cancel()
+    {
+      m_isCancelled.store(true, std::memory_order_relaxed);
+    }
+
+    bool IsCancelled() const
+    {
+      return m_isCancelled.load(std::memory_order_relaxed) || (m_parent != nullptr && m_parent->IsCancelled());
+    }
+
+    /** @brief Returns number of calculated items of started operations. */
+    std::uint64_t ItemsDone() const
+    {
+      return m_itemsDone.load(std::memory_order_relaxed);
+    }
+
+    /** @brief Returns number of items of started operations. It grows when operations start. */
+    std::uint64_t ItemsTotal() const
+    {
+      return m_itemsTotal.load(std::memory_order_relaxed);
+    }
+
+    /** @brief Called by the calculation when an operation over the given number of items starts. */
+    void AddTotal(const std::uint64_t items)
+    {
+      for (ExecControl* control = this; control != nullptr; control = control->m_parent)
+      {
+        control->m_itemsTotal.fetch_add(items, std::memory_order_relaxed);
+      }
+    }
+
+    /** @brief Called by the calculation when the given number of items is calculated. */
+    void AddDone(const std::uint64_t items)
+    {
+      for (ExecControl* control = this; control != nullptr; control = control->m_parent)
+      {
+        control->m_itemsDone.fetch_add(items, std::memory_order_relaxed);
+      }
+    }
+
+  private:
+    ExecControl* const m_parent;
+    std::atomic<bool> m_isCancelled;
+    std::atomic<std::uint64_t> m_itemsDone;
+    std::atomic<std::uint64_t> m_itemsTotal;
+  };
+
+  /** @brief ExecOptions controls how map() and reduce() are split into parallel jobs. */
+  struct ExecOptions
+  {
+    /** @brief Maximal number of jobs of an operation. 0 means the number of hardware threads. */
+    unsigned Threads;
+
+    /** @brief Minimal number of items of a job. Sequences shorter than two jobs are calculated by one job. */
+    size_t GrainSize;
+
+    /** @brief Calculate everything in the calling thread. */
+    bool IsSerial;
+
+    /**
+     * @brief Split reduce() into jobs of a fixed size and combine their results by a fixed tree.
+     *
+     * Results of real reductions are bit-identical for any number of threads and grain size, including
+     * the serial mode.
+     */
+    bool IsDeterministic;
+  };
+
+  /**
+    * @brief Returns default execution options.
+    *
+    * By default an operation has a job per hardware thread and jobs have at least 256 items.
+    * The defaults are overridden by environment variables ABACUS_THREADS, ABACUS_GRAIN_SIZE,
+    * ABACUS_SERIAL and ABACUS_DETERMINISTIC (1 enables the mode). They are read on the first call.
+    */
+  const ExecOptions& DefaultExecOptions();
 
   /** @brief The ResultBrief enum represents brief result of execution */
   enum ResultBrief
@@ -82,33 +185,132 @@ namespace Abacus
      */
     std::vector<std::string> Output;
 
-    /** @brief Variables which were defined and calculated during of execution. */
+    /**
+     * @brief Variables which were defined and calculated during of execution.
+     *
+     * @note A variable which is assigned a map() and used only once, as the sequence of map() or reduce() in the next
+     * statement, is calculated together with that statement and never stored, so it is not returned.
+     */
     State Variables;
   };
 
+  /**
+   * @brief Function which receives output of an out or print statement as soon as it is produced.
+   *
+   * @note It is called by worker threads, one call at a time, in order of statements, while no locks
+   *       of the execution are held. Output of statements which follow a failed statement is not passed.
+   *
+   * @note An exception of the handler is not passed to the caller. The statement whose output is
+   *       rejected fails with an "Output handler failed" error in ExecResult::Errors, following
+   *       statements are not run and no more output is passed.
+   */
+  typedef std::function<void(const std::string& output)> OutputHandler;
+
+  /** @brief ExecHandle is an execution which runs asynchronously. */
+  struct ExecHandle
+  {
+    /** @brief Result of execution. It is ready when the execution is finished. */
+    std::future<ExecResult> Result;
+
+    /** @brief Control which is used to terminate the execution and watch its progress. */
+    std::shared_ptr<ExecControl> Control;
+  };
+
+  /**
+    * @brief Program is a compiled text of statements.
+    *
+    * @note Program is immutable, so it can be run many times and concurrently from many threads.
+    */
+  class Program
+  {
+  public:
+    /**
+      * @brief Runs program
+      *
+      * @param variables Variables which are used in the program.
+      * @param control Control which is used to terminate the calculation and watch its progress. It may be nullptr.
+      * @param options Options of parallel calculation.
+      * @param onOutput Function which receives output of statements as soon as it is produced. It may be nullptr.
+      *
+      * @return Result of calculation in form of ExecResult.
+      *
+      * @note If compilation failed then statements preceding the error are executed and
+      *       the compilation error is reported in ExecResult::Errors.
+      */
+    ExecResult Run(const State& variables,
+                   ExecControl* control = nullptr,
+                   const ExecOptions& options = DefaultExecOptions(),
+                   const OutputHandler& onOutput = nullptr) const;
+
+    /** @brief Errors happened during of compilation. */
+    const std::vector<Error>& Errors() const;
+
+  private:
+    struct Impl;
+
+    explicit Program(std::shared_ptr<const Impl> impl);
+
+    friend Program Compile(const std::string& text);
+
+    std::shared_ptr<const Impl> m_impl;
+  };
+
+  /**
+    * @brief Compiles statements to be run many times
+    *
+    * @param text String with statements to be compiled.
+    *
+    * @return Compiled program. Compilation errors are available via Program::Errors().
+    */
+  Program Compile(const std::string& text);
+
   /**
     * @brief Calculates expression
     *
     * @param expression String with expression to be calculated.
     * @param variables Variables which are used in the expression.
-    * @param isTerminating Function which should be used to check if calculation termination was requested.
+    * @param control Control which is used to terminate the calculation and watch its progress. It may be nullptr.
+    * @param options Options of parallel calculation.
     *
     * @return Result of calculation in form of Universal.
     */
   Universal Calculate(const std::string& expression,
                       const State& variables,
-                      IsTerminating isTerminating);
+                      ExecControl* control,
+                      const ExecOptions& options = DefaultExecOptions());
 
   /**
     * @brief Execute statement
     *
     * @param statement String with statement to be executed.
     * @param variables Variables which are used in the statement.
-    * @param isTerminating Function which should be used to check if calculation termination was requested.
+    * @param control Control which is used to terminate the calculation and watch its progress. It may be nullptr.
+    * @param options Options of parallel calculation.
     *
     * @return Result of calculation in form of ExecResult.
     */
   ExecResult Execute(const std::string& statement,
                      const State& variables,
-                     IsTerminating isTerminating);
+                     ExecControl* control,
+                     const ExecOptions& options = DefaultExecOptions());
+
+  /**
+    * @brief Executes statement asynchronously by the thread pool
+    *
+    * The statement is compiled and run by a pool task, so the caller is not blocked.
+    *
+    * @param statement String with statement to be executed.
+    * @param variables Variables which are used in the statement.
+    * @param parentControl Control of the caller which terminates the execution too and receives its progress.
+    *                      It may be nullptr, otherwise it must live until the execution is finished.
+    * @param onOutput Function which receives output of statements as soon as it is produced. It may be nullptr.
+    * @param options Options of parallel calculation.
+    *
+    * @return Handle of the execution. ExecResult::Output contains the whole output too.
+    */
+  ExecHandle ExecuteAsync(const std::string& statement,
+                          const State& variables,
+                          ExecControl* parentControl = nullptr,
+                          OutputHandler onOutput = nullptr,
+                          const ExecOptions& options = DefaultExecOptions());
 }
@@ -2,6 +2,7 @@
 
 #include "ExprCalc.h"
 
+#include "Ast.h"
 #include "Common.h"
 #include "MapParse.h"
 #include "BinaryStack.h"
@@ -9,6 +10,8 @@
 #include "SequenceParse.h"
 
 #include <map>
+#include <limits>
+#include <algorithm>
 #include <vector>
 #include <cfloat>
 #include <climits>
@@ -24,10 +27,8 @@ namespace Abacus
         template<typename Input>
         bool Parse(
                 Input& input,
-                const IsTerminating& isTerminating,
-                const unsigned threads,
-                const State& variables,
-                Universal& result);
+                const Ast::Scope& scope,
+                Ast::NodePtr& result);
         
         struct Real : seq<
             opt< one<'+', '-'> >,
@@ -73,24 +74,22 @@ namespace Abacus
                 typename Input >
             static bool match(
                     Input& input,
-                    const IsTerminating&,
-                    const unsigned,
                     BinaryStacks& stacks,
-                    const State&)
+                    const Ast::Scope&)
             {
                 struct BinaryOperatorDef
                 {
                     int Priority;
-                    BinaryOperator::FuncType Func;
+                    Ast::Operators Operator;
                 };
 
                 static const std::map<char, BinaryOperatorDef> BIN_OPERATORS =
                 {
-                    { '+', { 10, Add } },
-                    { '-', { 10, Sub } },
-                    { '/', { 20, Div } },
-                    { '*', { 30, Mul } },
-                    { '^', { 40, Pow } }
+                    { '+', { 10, Ast::Operators::ADD } },
+                    { '-', { 10, Ast::Operators::SUB } },
+                    { '/', { 20, Ast::Operators::DIV } },
+                    { '*', { 30, Ast::Operators::MUL } },
+                    { '^', { 40, Ast::Operators::POW } }
                 };
 
                 const auto opDefIt = BIN_OPERATORS.find(input.peek_char(0));
@@ -98,7 +97,7 @@ namespace Abacus
                 {
                     const BinaryOperatorDef& opDef = opDefIt->second;
 
-                    stacks.PushOperator(BinaryOperator { opDef.Priority, opDef.Func, input.position() } );
+                    stacks.PushOperator(BinaryOperator { opDef.Priority, opDef.Operator, input.position() } );
 
                     input.bump(1U);
                     
@@ -121,15 +120,13 @@ namespace Abacus
                 typename Input>
             static bool match(
                     Input& input,
-                    const IsTerminating& isTerminating,
-                    const unsigned threads,
                     BinaryStacks& stacks,
-                    const State& variables)
+                    const Ast::Scope& scope)
             {
-                Universal result;
-                if (Map::Parse(input, isTerminating, threads, variables, result))
+                Ast::NodePtr result;
+                if (Map::Parse(input, scope, result))
                 {
-                    stacks.PushUniversal(result);
+                    stacks.PushNode(std::move(result));
                     return true;
                 }
                 
@@ -149,15 +146,13 @@ namespace Abacus
                 typename Input>
             static bool match(
                     Input& input,
-                    const IsTerminating& isTerminating,
-                    const unsigned threads,
                     BinaryStacks& stacks,
-                    const State& variables)
+                    const Ast::Scope& scope)
             {
-                Universal result;
-                if (Reduce::Parse(input, isTerminating, threads, variables, result))
+                Ast::NodePtr result;
+                if (Reduce::Parse(input, scope, result))
                 {
-                    stacks.PushUniversal(result);
+                    stacks.PushNode(std::move(result));
                     return true;
                 }
                 
@@ -177,15 +172,13 @@ namespace Abacus
                 typename Input>
             static bool match(
                     Input& input,
-                    const IsTerminating& isTerminating,
-                    const unsigned threads,
                     BinaryStacks& stacks,
-                    const State& variables)
+                    const Ast::Scope& scope)
             {
-                Universal result;
-                if (Sequence::Parse(input, isTerminating, threads, variables, result))
+                Ast::NodePtr result;
+                if (Sequence::Parse(input, scope, result))
                 {
-                    stacks.PushUniversal(result);
+                    stacks.PushNode(std::move(result));
                     return true;
                 }
                 
@@ -209,27 +202,30 @@ namespace Abacus
             template< typename Input >
             static void apply(
                     const Input& input,
-                    const IsTerminating&,
-                    const unsigned,
                     BinaryStacks& stacks,
-                    const State&)
+                    const Ast::Scope&)
             {
                 std::string strVal = input.string();
 
-                int val;
+                Universal::Int val;
 
                 try
                 {
-                    val = std::stoi(strVal);
+                    val = std::stoll(strVal);
                 }
                 catch (const std::exception& ex)
                 {
-                    throw parse_error(Print("Expected integer number value in range [%i, %i]. Error: %s",
-                                            INT_MIN, INT_MAX, ex.what()),
+                    throw parse_error(Print("Expected integer number value in range [%lld, %lld]. Error: %s",
+                                            static_cast<long long>(std::numeric_limits<Universal::Int>::min()),
+                                            static_cast<long long>(std::numeric_limits<Universal::Int>::max()),
+                                            ex.what()),
                                       input);
                 }
 
-                stacks.PushUniversal(Universal(val));
+                Ast::NodePtr node = Ast::MakeNode(Ast::Node::Kinds::CONSTANT, input.position());
+                node->Value = Universal(val);
+
+                stacks.PushNode(std::move(node));
             }
         };
         
@@ -239,10 +235,8 @@ namespace Abacus
             template< typename Input >
             static void apply(
                     const Input& input,
-                    const IsTerminating&,
-                    const unsigned,
                     BinaryStacks& stacks,
-                    const State&)
+                    const Ast::Scope&)
             {
                 std::string strVal = input.string();
 
@@ -259,7 +253,10 @@ namespace Abacus
                                       input);
                 }
 
-                stacks.PushUniversal(Universal(val));
+                Ast::NodePtr node = Ast::MakeNode(Ast::Node::Kinds::CONSTANT, input.position());
+                node->Value = Universal(val);
+
+                stacks.PushNode(std::move(node));
             }
         };
         
@@ -269,17 +266,27 @@ namespace Abacus
             template< typename Input >
             static void apply(
                     const Input& input,
-                    const IsTerminating&,
-                    const unsigned,
                     BinaryStacks& stacks,
-                    const State& variables)
+                    const Ast::Scope& scope)
             {
                 std::string strVal = input.string();
 
-                const auto it = variables.find(strVal);
-                if (it != variables.cend())
+                const auto it = std::find(scope.Parameters.cbegin(), scope.Parameters.cend(), strVal);
+                if (it != scope.Parameters.cend())
+                {
+                    Ast::NodePtr node = Ast::MakeNode(Ast::Node::Kinds::PARAMETER, input.position());
+                    node->Slot = static_cast<unsigned>(it - scope.Parameters.cbegin());
+
+                    stacks.PushNode(std::move(node));
+                    return;
+                }
+
+                if (scope.HasVariables)
                 {
-                    stacks.PushUniversal(it->second);
+                    Ast::NodePtr node = Ast::MakeNode(Ast::Node::Kinds::VARIABLE, input.position());
+                    node->Name = strVal;
+
+                    stacks.PushNode(std::move(node));
                     return;
                 }
                 
@@ -290,7 +297,7 @@ namespace Abacus
         template<>
         struct Action< one<'('> >
         {
-            static void apply0(const IsTerminating&, const unsigned, BinaryStacks& stacks, const State&)
+            static void apply0(BinaryStacks& stacks, const Ast::Scope&)
             {
                 stacks.Open();
             }
@@ -299,7 +306,7 @@ namespace Abacus
         template<>
         struct Action< one<')'> >
         {
-            static void apply0(const IsTerminating&, const unsigned, BinaryStacks& stacks, const State&)
+            static void apply0(BinaryStacks& stacks, const Ast::Scope&)
             {
                 stacks.Close();
             }
@@ -308,16 +315,14 @@ namespace Abacus
         template<typename Input>
         bool Parse(
                 Input& input,
-                const IsTerminating& isTerminating,
-                const unsigned threads,
-                const State& variables,
-                Universal& result)
+                const Ast::Scope& scope,
+                Ast::NodePtr& result)
         {
             BinaryStacks stacks;
             
-            if (parse<Expression, Action>(input, isTerminating, threads, stacks, variables))
+            if (parse<Expression, Action>(input, stacks, scope))
             {
-                result = stacks.Calculate();
+                result = stacks.Build();
                 
                 return true;
             }
@@ -327,19 +332,17 @@ namespace Abacus
 
         template<typename Input>
         void Expect(Input& input,
-                    const IsTerminating& isTerminating,
-                    const unsigned threads,
-                    const State& variables,
-                    Universal& result)
+                    const Ast::Scope& scope,
+                    Ast::NodePtr& result)
         {
             BinaryStacks stacks;
 
-            if (!parse<Expression, Action>(input, isTerminating, threads, stacks, variables))
+            if (!parse<Expression, Action>(input, stacks, scope))
             {
               throw parse_error("Expected expression", input);
             }
 
-            result = stacks.Calculate();
+            result = stacks.Build();
         }
     }
 }
@@ -0,0 +1,607 @@
+#include "Kernel.h"
+
+#include <tao/pegtl.hpp>
+
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <limits>
+#include <algorithm>
+#include <type_traits>
+
+namespace Abacus
+{
+  namespace Kernel
+  {
+    using tao::TAOCPP_PEGTL_NAMESPACE::parse_error;
+    using tao::TAOCPP_PEGTL_NAMESPACE::position;
+
+    namespace Isa
+    {
+      /** @brief Returns true if CPU and OS support the instruction set. */
+      static bool IsSupported(const Levels level)
+      {
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+        __builtin_cpu_init();
+
+        switch (level)
+        {
+          case Levels::AVX2:
+            return __builtin_cpu_supports("avx2");
+          case Levels::AVX512:
+            return __builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512dq");
+          default:
+            return true;
+        }
+#else
+        return level == Levels::SSE2;
+#endif
+      }
+
+      /** @brief Returns the best instruction set which is allowed by ABACUS_KERNEL_ISA. */
+      static Levels MaxLevel()
+      {
+        const char* const name = std::getenv("ABACUS_KERNEL_ISA");
+
+        if (name != nullptr && std::strcmp(name, "sse2") == 0)
+        {
+          return Levels::SSE2;
+        }
+
+        if (name != nullptr && std::strcmp(name, "avx2") == 0)
+        {
+          return Levels::AVX2;
+        }
+
+        return Levels::AVX512;
+      }
+
+      static const Ops& Select()
+      {
+        struct Candidate
+        {
+          Levels Level;
+          const Ops* (*Loops)();
+        };
+
+        static const Candidate CANDIDATES[] = { { Levels::AVX512, &Avx512 }, { Levels::AVX2, &Avx2 } };
+
+        const Levels maxLevel = MaxLevel();
+
+        // Loops are requested only after CPU is checked, no code of other sets runs before.
+        for (const auto& candidate : CANDIDATES)
+        {
+          if (candidate.Level <= maxLevel && IsSupported(candidate.Level))
+          {
+            const Ops* const ops = candidate.Loops();
+            if (ops != nullptr)
+            {
+              return *ops;
+            }
+          }
+        }
+
+        return *Sse2();
+      }
+
+      const Ops& Selected()
+      {
+        static const Ops& ops = Select();
+
+        return ops;
+      }
+    }
+
+    /** @brief Copies items [beginIdx, endIdx) of input to output. Ranges are filled by the selected loops. */
+    static void Load(const Isa::Ops& ops,
+                     const SharedArray<Universal::Int>& input,
+                     const size_t beginIdx,
+                     const size_t endIdx,
+                     Universal::Int* output)
+    {
+      if (input.IsRange())
+      {
+        ops.FillRange(input[beginIdx], input.Step(), endIdx - beginIdx, output);
+      }
+      else
+      {
+        input.Copy(beginIdx, endIdx, output);
+      }
+    }
+
+    static void Load(const Isa::Ops& /*ops*/,
+                     const SharedArray<double>& input,
+                     const size_t beginIdx,
+                     const size_t endIdx,
+                     double* output)
+    {
+      input.Copy(beginIdx, endIdx, output);
+    }
+
+    const size_t MapKernel::BATCH_SIZE;
+
+    bool MapKernel::IsSupported(const Vm::Function& function)
+    {
+      if (function.Parameters.size() != 1U ||
+          (function.ResultType != Universal::Types::INTEGER && function.ResultType != Universal::Types::REAL))
+      {
+        return false;
+      }
+
+      for (size_t idx = function.Entry; idx < function.Code.size(); ++idx)
+      {
+        switch (function.Code[idx].Op)
+        {
+          case Vm::OpCode::ADD_INTEGER:
+          case Vm::OpCode::SUB_INTEGER:
+          case Vm::OpCode::MUL_INTEGER:
+          case Vm::OpCode::ADD_REAL:
+          case Vm::OpCode::SUB_REAL:
+          case Vm::OpCode::MUL_REAL:
+          case Vm::OpCode::DIV_REAL:
+          case Vm::OpCode::POW_REAL:
+          case Vm::OpCode::TO_REAL:
+          case Vm::OpCode::RETURN:
+            break;
+
+          default:
+            return false;
+        }
+      }
+
+      return true;
+    }
+
+    MapKernel::MapKernel(const Vm::Function& function, const Vm::Frame& frame)
+      : m_function(function),
+        m_ops(Isa::Selected()),
+        m_columns(new Value[function.RegistersNumber * BATCH_SIZE]),
+        m_isParity(function.Code.size(), false)
+    {
+      std::vector<bool> isWritten(function.RegistersNumber, false);
+      isWritten[0] = true;
+
+      for (size_t idx = function.Entry; idx < function.Code.size(); ++idx)
+      {
+        if (function.Code[idx].Op != Vm::OpCode::RETURN)
+        {
+          isWritten[function.Code[idx].A] = true;
+        }
+      }
+
+      // Registers which are not written by the lambda keep the same value for all items.
+      for (unsigned reg = 0; reg < function.RegistersNumber; ++reg)
+      {
+        const Universal& value = frame.Registers[reg];
+        if (isWritten[reg] || !value.IsNumber())
+        {
+          continue;
+        }
+
+        Value* const column = m_columns.get() + reg * BATCH_SIZE;
+        for (size_t idx = 0; idx < BATCH_SIZE; ++idx)
+        {
+          if (value.Type == Universal::Types::INTEGER)
+          {
+            column[idx].Integer = value.Integer;
+          }
+          else
+          {
+            column[idx].Real = value.Real;
+          }
+        }
+      }
+
+      // (-1)^x is often used for alternating series, it does not need std::pow() for integer x.
+      for (size_t idx = function.Entry; idx < function.Code.size(); ++idx)
+      {
+        const Vm::Instruction& instr = function.Code[idx];
+        if (instr.Op == Vm::OpCode::POW_REAL && !isWritten[instr.B])
+        {
+          const Universal& base = frame.Registers[instr.B];
+          m_isParity[idx] = base.Type == Universal::Types::REAL && base.Real == -1.0;
+        }
+      }
+    }
+
+    void MapKernel::Execute(const size_t size)
+    {
+      Value* const r = m_columns.get();
+
+      for (size_t instrIdx = m_function.Entry; instrIdx < m_function.Code.size(); ++instrIdx)
+      {
+        const Vm::Instruction& instr = m_function.Code[instrIdx];
+        if (instr.Op == Vm::OpCode::RETURN)
+        {
+          return;
+        }
+
+        Value* const a = r + instr.A * BATCH_SIZE;
+        const Value* const b = r + instr.B * BATCH_SIZE;
+        const Value* const c = r + instr.C * BATCH_SIZE;
+
+        bool overflow = false;
+
+        switch (instr.Op)
+        {
+          case Vm::OpCode::ADD_INTEGER:
+            overflow = m_ops.AddIntegers(a, b, c, size);
+            break;
+
+          case Vm::OpCode::SUB_INTEGER:
+            overflow = m_ops.SubIntegers(a, b, c, size);
+            break;
+
+          case Vm::OpCode::MUL_INTEGER:
+            overflow = m_ops.MulIntegers(a, b, c, size);
+            break;
+
+          case Vm::OpCode::ADD_REAL:
+            m_ops.AddReals(a, b, c, size);
+            break;
+
+          case Vm::OpCode::SUB_REAL:
+            m_ops.SubReals(a, b, c, size);
+            break;
+
+          case Vm::OpCode::MUL_REAL:
+            m_ops.MulReals(a, b, c, size);
+            break;
+
+          case Vm::OpCode::DIV_REAL:
+            m_ops.DivReals(a, b, c, size);
+            break;
+
+          case Vm::OpCode::POW_REAL:
+            if (m_isParity[instrIdx])
+            {
+              m_ops.Parity(a, c, size);
+            }
+            else
+            {
+              m_ops.PowReals(a, b, c, size);
+            }
+            break;
+
+          case Vm::OpCode::TO_REAL:
+            m_ops.ToReals(a, b, size);
+            break;
+
+          default:
+            throw parse_error("Internal error: operation is not supported by map kernel.",
+                              m_function.Nodes[instrIdx]->Pos);
+        }
+
+        if (overflow)
+        {
+          throw parse_error("Overflow", m_function.Nodes[instrIdx]->Pos);
+        }
+      }
+    }
+
+    template<typename IT, typename OT>
+    void MapKernel::Run(const SharedArray<IT>& input, const size_t beginIdx, const size_t endIdx, OT* output)
+    {
+      const Vm::Instruction& ret = m_function.Code.back();
+      Value* const param = m_columns.get();
+      const Value* const result = m_columns.get() + ret.A * BATCH_SIZE;
+
+      IT items[BATCH_SIZE];
+
+      for (size_t batchIdx = beginIdx; batchIdx < endIdx; batchIdx += BATCH_SIZE)
+      {
+        const size_t size = std::min(BATCH_SIZE, endIdx - batchIdx);
+
+        Load(m_ops, input, batchIdx, batchIdx + size, items);
+
+        for (size_t idx = 0; idx < size; ++idx)
+        {
+          if (std::is_same<IT, Universal::Int>::value)
+          {
+            param[idx].Integer = static_cast<Universal::Int>(items[idx]);
+          }
+          else
+          {
+            param[idx].Real = static_cast<double>(items[idx]);
+          }
+        }
+
+        Execute(size);
+
+        for (size_t idx = 0; idx < size; ++idx)
+        {
+          output[batchIdx - beginIdx + idx] = m_function.ResultType == Universal::Types::INTEGER ?
+                static_cast<OT>(result[idx].Integer) : static_cast<OT>(result[idx].Real);
+        }
+      }
+    }
+
+    template void MapKernel::Run(const SharedArray<Universal::Int>&, size_t, size_t, Universal::Int*);
+    template void MapKernel::Run(const SharedArray<Universal::Int>&, size_t, size_t, double*);
+    template void MapKernel::Run(const SharedArray<double>&, size_t, size_t, Universal::Int*);
+    template void MapKernel::Run(const SharedArray<double>&, size_t, size_t, double*);
+
+    size_t ReduceKernel::FindOperation(const Vm::Function& function)
+    {
+      const size_t notFound = function.Code.size();
+
+      if (function.Parameters.size() != 2U ||
+          (function.ResultType != Universal::Types::INTEGER && function.ResultType != Universal::Types::REAL))
+      {
+        return notFound;
+      }
+
+      // Lambda code is expected to be [TO_REAL item], acc OP item, RETURN.
+      size_t idx = function.Entry;
+      unsigned item = 1U;
+
+      if (idx < function.Code.size() &&
+          function.Code[idx].Op == Vm::OpCode::TO_REAL &&
+          function.Code[idx].B == 1U)
+      {
+        item = function.Code[idx].A;
+        ++idx;
+      }
+
+      if (idx + 2U != function.Code.size())
+      {
+        return notFound;
+      }
+
+      const Vm::Instruction& operation = function.Code[idx];
+      const Vm::Instruction& ret = function.Code[idx + 1U];
+
+      const bool isSupportedOperation =
+          operation.Op == Vm::OpCode::ADD_INTEGER || operation.Op == Vm::OpCode::MUL_INTEGER ||
+          operation.Op == Vm::OpCode::ADD_REAL || operation.Op == Vm::OpCode::MUL_REAL;
+      const bool isAccOpItem =
+          (operation.B == 0U && operation.C == item) || (operation.B == item && operation.C == 0U);
+
+      if (!isSupportedOperation || !isAccOpItem || ret.Op != Vm::OpCode::RETURN || ret.A != operation.A)
+      {
+        return notFound;
+      }
+
+      return idx;
+    }
+
+    bool ReduceKernel::IsSupported(const Vm::Function& function)
+    {
+      return FindOperation(function) != function.Code.size();
+    }
+
+    ReduceKernel::ReduceKernel(const Vm::Function& function)
+      : m_function(function),
+        m_ops(Isa::Selected()),
+        m_operation(FindOperation(function))
+    {
+    }
+
+    /** @brief Returns absolute value of an integer. It does not overflow for the minimal integer. */
+    static std::uint64_t Magnitude(const Universal::Int value)
+    {
+      return value < 0 ? 0U - static_cast<std::uint64_t>(value) : static_cast<std::uint64_t>(value);
+    }
+
+    static void SumItems(const Isa::Ops& ops,
+                         const Universal::Int* items,
+                         const size_t size,
+                         std::uint64_t& sum,
+                         std::uint64_t& maxMagnitude)
+    {
+      ops.SumIntegers(items, size, sum, maxMagnitude);
+    }
+
+    /** @brief Real items are never summed as integers by supported lambdas. It is required to instantiate Reduce(). */
+    static void SumItems(const Isa::Ops& /*ops*/,
+                         const double* items,
+                         const size_t size,
+                         std::uint64_t& sum,
+                         std::uint64_t& maxMagnitude)
+    {
+      sum = 0U;
+      maxMagnitude = 0U;
+
+      for (size_t idx = 0; idx < size; ++idx)
+      {
+        const Universal::Int item = static_cast<Universal::Int>(items[idx]);
+        sum += static_cast<std::uint64_t>(item);
+        maxMagnitude = std::max(maxMagnitude, Magnitude(item));
+      }
+    }
+
+    /**
+     * @brief Adds items to acc.
+     *
+     * Items are summed with wrapping arithmetic together with their maximal magnitude. If acc and
+     * items are small enough, no partial sum can overflow and the wrapped sum is exact. Otherwise
+     * items are added one by one, so overflow is reported exactly as by the lambda.
+     */
+    template<typename IT>
+    static Universal::Int SumIntegers(const Isa::Ops& ops,
+                                      Universal::Int acc,
+                                      const IT* items,
+                                      const size_t size,
+                                      const position& pos)
+    {
+      std::uint64_t sum = 0U;
+      std::uint64_t maxMagnitude = 0U;
+
+      SumItems(ops, items, size, sum, maxMagnitude);
+
+      static const std::uint64_t MAX_MAGNITUDE = static_cast<std::uint64_t>(std::numeric_limits<Universal::Int>::max());
+
+      const std::uint64_t accMagnitude = Magnitude(acc);
+      if (accMagnitude <= MAX_MAGNITUDE && maxMagnitude <= (MAX_MAGNITUDE - accMagnitude) / size)
+      {
+        return static_cast<Universal::Int>(static_cast<std::uint64_t>(acc) + sum);
+      }
+
+      for (size_t idx = 0; idx < size; ++idx)
+      {
+        if (__builtin_add_overflow(acc, static_cast<Universal::Int>(items[idx]), &acc))
+        {
+          throw parse_error("Overflow", pos);
+        }
+      }
+
+      return acc;
+    }
+
+    template<typename IT>
+    static Universal::Int MultiplyIntegers(Universal::Int acc, const IT* items, const size_t size, const position& pos)
+    {
+      for (size_t idx = 0; idx < size && acc != 0; ++idx)
+      {
+        if (__builtin_mul_overflow(acc, static_cast<Universal::Int>(items[idx]), &acc))
+        {
+          throw parse_error("Overflow", pos);
+        }
+      }
+
+      return acc;
+    }
+
+    static double SumReals(const Isa::Ops& ops, const Universal::Int* items, const size_t size)
+    {
+      return ops.SumIntegersAsReals(items, size);
+    }
+
+    static double SumReals(const Isa::Ops& ops, const double* items, const size_t size)
+    {
+      return ops.SumReals(items, size);
+    }
+
+    static double MultiplyReals(const Isa::Ops& ops, const Universal::Int* items, const size_t size)
+    {
+      return ops.MultiplyIntegersAsReals(items, size);
+    }
+
+    static double MultiplyReals(const Isa::Ops& ops, const double* items, const size_t size)
+    {
+      return ops.MultiplyReals(items, size);
+    }
+
+    /**
+     * @brief CascadeSum adds sums of batches pairwise: two sums of the same number of batches are
+     *        added together like digits of a binary counter.
+     */
+    class CascadeSum
+    {
+    public:
+      void Add(double sum)
+      {
+        size_t level = 0;
+        for (size_t count = m_count; (count & 1U) != 0; count >>= 1U, ++level)
+        {
+          sum += m_levels[level];
+        }
+
+        m_levels[level] = sum;
+        ++m_count;
+      }
+
+      double Sum() const
+      {
+        double sum = 0.0;
+        for (size_t level = 0; (m_count >> level) != 0; ++level)
+        {
+          if (((m_count >> level) & 1U) != 0)
+          {
+            sum += m_levels[level];
+          }
+        }
+
+        return sum;
+      }
+
+    private:
+      size_t m_count = 0;
+      double m_levels[64];
+    };
+
+    template<typename AT, typename IT, typename Load>
+    AT ReduceKernel::Reduce(AT acc, const size_t size, const Load& load) const
+    {
+      const Vm::OpCode op = m_function.Code[m_operation].Op;
+      const position& pos = m_function.Nodes[m_operation]->Pos;
+
+      IT buffer[MapKernel::BATCH_SIZE];
+
+      CascadeSum cascadeSum;
+      double realSum = 0.0;
+      double realProduct = 1.0;
+
+      for (size_t batchIdx = 0; batchIdx < size; batchIdx += MapKernel::BATCH_SIZE)
+      {
+        const size_t batchSize = std::min(MapKernel::BATCH_SIZE, size - batchIdx);
+        const IT* const items = load(batchIdx, batchSize, buffer);
+
+        switch (op)
+        {
+          case Vm::OpCode::ADD_INTEGER:
+            acc = static_cast<AT>(SumIntegers(m_ops, static_cast<Universal::Int>(acc), items, batchSize, pos));
+            break;
+
+          case Vm::OpCode::MUL_INTEGER:
+            acc = static_cast<AT>(MultiplyIntegers(static_cast<Universal::Int>(acc), items, batchSize, pos));
+            break;
+
+          case Vm::OpCode::ADD_REAL:
+#ifdef ABACUS_PAIRWISE_SUMMATION
+            cascadeSum.Add(SumReals(m_ops, items, batchSize));
+#else
+            realSum += SumReals(m_ops, items, batchSize);
+#endif
+            break;
+
+          default:
+            realProduct *= MultiplyReals(m_ops, items, batchSize);
+            break;
+        }
+      }
+
+      if (op == Vm::OpCode::ADD_REAL)
+      {
+        acc = static_cast<AT>(acc + cascadeSum.Sum() + realSum);
+      }
+      else if (op == Vm::OpCode::MUL_REAL)
+      {
+        acc = static_cast<AT>(acc * realProduct);
+      }
+
+      return acc;
+    }
+
+    template<typename AT, typename IT>
+    AT ReduceKernel::Run(AT acc, const IT* items, const size_t size) const
+    {
+      return Reduce<AT, IT>(acc, size, [items](const size_t idx, const size_t /*size*/, IT* /*buffer*/) { return items + idx; });
+    }
+
+    template<typename AT, typename IT>
+    AT ReduceKernel::Run(AT acc, const SharedArray<IT>& input, const size_t beginIdx, const size_t endIdx) const
+    {
+      if (!input.IsRange())
+      {
+        return Run(acc, input.Items().data() + beginIdx, endIdx - beginIdx);
+      }
+
+      return Reduce<AT, IT>(acc, endIdx - beginIdx, [this, &input, beginIdx](const size_t idx, const size_t size, IT* buffer)
+      {
+        Load(m_ops, input, beginIdx + idx, beginIdx + idx + size, buffer);
+        return static_cast<const IT*>(buffer);
+      });
+    }
+
+    template Universal::Int ReduceKernel::Run(Universal::Int, const Universal::Int*, size_t) const;
+    template Universal::Int ReduceKernel::Run(Universal::Int, const double*, size_t) const;
+    template double ReduceKernel::Run(double, const Universal::Int*, size_t) const;
+    template double ReduceKernel::Run(double, const double*, size_t) const;
+
+    template Universal::Int ReduceKernel::Run(Universal::Int, const SharedArray<Universal::Int>&, size_t, size_t) const;
+    template Universal::Int ReduceKernel::Run(Universal::Int, const SharedArray<double>&, size_t, size_t) const;
+    template double ReduceKernel::Run(double, const SharedArray<Universal::Int>&, size_t, size_t) const;
+    template double ReduceKernel::Run(double, const SharedArray<double>&, size_t, size_t) const;
+  }
+}
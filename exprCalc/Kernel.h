@@ -0,0 +1,106 @@
+#pragma once
+
+#include "Vm.h"
+#include "KernelIsa.h"
+#include "Universal.h"
+
+#include <memory>
+#include <vector>
+
+namespace Abacus
+{
+  namespace Kernel
+  {
+    /**
+     * @brief MapKernel calculates map() lambda for a batch of items at once.
+     *
+     * Every register of the lambda is a column of values, so every instruction is a loop over
+     * the batch which the compiler vectorizes for the instruction set selected at run time.
+     * Registers which are not changed by the lambda (constants and results of the prologue)
+     * are filled once.
+     *
+     * @note Only lambdas whose per-item code consists of typed arithmetic operations are supported.
+     */
+    class MapKernel
+    {
+    public:
+      /** @brief Number of items which are calculated by one pass over the lambda code. */
+      static const size_t BATCH_SIZE = 256U;
+
+      /** @brief Returns true if the lambda can be calculated by the kernel. */
+      static bool IsSupported(const Vm::Function& function);
+
+      /**
+       * @param function Lambda which is supported by the kernel.
+       * @param frame Frame of the lambda with calculated prologue.
+       */
+      MapKernel(const Vm::Function& function, const Vm::Frame& frame);
+
+      /**
+       * @brief Calculates lambda for items [beginIdx, endIdx) of input and stores results to output[0, endIdx - beginIdx).
+       *
+       * @throw parse_error if calculation failed.
+       */
+      template<typename IT, typename OT>
+      void Run(const SharedArray<IT>& input, size_t beginIdx, size_t endIdx, OT* output);
+
+    private:
+      void Execute(size_t size);
+
+      const Vm::Function& m_function;
+      const Isa::Ops& m_ops;
+
+      /** @brief Columns of registers. */
+      std::unique_ptr<Value[]> m_columns;
+
+      /** @brief Instructions which calculate (-1)^x for integer x. */
+      std::vector<bool> m_isParity;
+    };
+
+    /**
+     * @brief ReduceKernel calculates reduce() with lambda which is a sum or a product of its parameters.
+     *
+     * @note Integer results are the same as results of the lambda called item by item, overflow
+     *       is reported for the same items. Real numbers are accumulated in several partial results,
+     *       so they may differ in the last digits. Sums of real numbers are pairwise if the library is
+     *       built with ABACUS_PAIRWISE_SUMMATION.
+     */
+    class ReduceKernel
+    {
+    public:
+      /** @brief Returns true if the lambda variant can be calculated by the kernel. */
+      static bool IsSupported(const Vm::Function& function);
+
+      explicit ReduceKernel(const Vm::Function& function);
+
+      /**
+       * @brief Reduces items [beginIdx, endIdx) of input starting from acc.
+       *
+       * @throw parse_error if calculation failed.
+       */
+      template<typename AT, typename IT>
+      AT Run(AT acc, const SharedArray<IT>& input, size_t beginIdx, size_t endIdx) const;
+
+      /** @brief Reduces items [0, size) of array starting from acc. */
+      template<typename AT, typename IT>
+      AT Run(AT acc, const IT* items, size_t size) const;
+
+      template<typename AT, typename IT>
+      AT Run(AT acc, const std::vector<IT>& items, const size_t beginIdx, const size_t endIdx) const
+      {
+        return Run(acc, items.data() + beginIdx, endIdx - beginIdx);
+      }
+
+    private:
+      template<typename AT, typename IT, typename Load>
+      AT Reduce(AT acc, size_t size, const Load& load) const;
+
+      /** @brief Index of the instruction which combines the parameters. */
+      static size_t FindOperation(const Vm::Function& function);
+
+      const Vm::Function& m_function;
+      const Isa::Ops& m_ops;
+      const size_t m_operation;
+    };
+  }
+}
@@ -0,0 +1,27 @@
+#include "KernelIsa.h"
+
+// The file is built with AVX2 flags if the compiler supports them, otherwise the set is not available.
+#ifdef __AVX2__
+
+#define ABACUS_KERNEL_LEVEL Levels::AVX2
+#include "KernelLoops.h"
+
+#endif
+
+namespace Abacus
+{
+  namespace Kernel
+  {
+    namespace Isa
+    {
+      const Ops* Avx2()
+      {
+#ifdef __AVX2__
+        return &LOOPS;
+#else
+        return nullptr;
+#endif
+      }
+    }
+  }
+}
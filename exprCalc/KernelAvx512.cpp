@@ -0,0 +1,27 @@
+#include "KernelIsa.h"
+
+// The file is built with AVX-512 flags if the compiler supports them, otherwise the set is not available.
+#if defined(__AVX512F__) && defined(__AVX512DQ__)
+
+#define ABACUS_KERNEL_LEVEL Levels::AVX512
+#include "KernelLoops.h"
+
+#endif
+
+namespace Abacus
+{
+  namespace Kernel
+  {
+    namespace Isa
+    {
+      const Ops* Avx512()
+      {
+#if defined(__AVX512F__) && defined(__AVX512DQ__)
+        return &LOOPS;
+#else
+        return nullptr;
+#endif
+      }
+    }
+  }
+}
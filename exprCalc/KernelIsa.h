@@ -0,0 +1,82 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+namespace Abacus
+{
+  namespace Kernel
+  {
+    /** @brief Value is an item of a kernel column. Its type is known from the instruction. */
+    union Value
+    {
+      std::int64_t Integer;
+      double Real;
+    };
+
+    /**
+     * @brief Isa contains kernel loops compiled for several instruction sets.
+     *
+     * Every instruction set is a separate translation unit built with its own compiler flags.
+     * The best set supported by CPU is selected at run time, so one binary runs on all CPUs.
+     * Loops of all sets calculate the same results, only their speed differs.
+     */
+    namespace Isa
+    {
+      enum class Levels : unsigned char
+      {
+        SSE2,   // Baseline of x86-64. It is generic code on other architectures.
+        AVX2,
+        AVX512  // AVX-512 F and DQ.
+      };
+
+      /** @brief Ops is a table of kernel loops. Integer operations return true if any item overflowed. */
+      struct Ops
+      {
+        Levels Level;
+
+        // Column operations of map kernel: a[idx] = b[idx] OP c[idx] for idx in [0, size).
+        bool (*AddIntegers)(Value* a, const Value* b, const Value* c, size_t size);
+        bool (*SubIntegers)(Value* a, const Value* b, const Value* c, size_t size);
+        bool (*MulIntegers)(Value* a, const Value* b, const Value* c, size_t size);
+        void (*AddReals)(Value* a, const Value* b, const Value* c, size_t size);
+        void (*SubReals)(Value* a, const Value* b, const Value* c, size_t size);
+        void (*MulReals)(Value* a, const Value* b, const Value* c, size_t size);
+        void (*DivReals)(Value* a, const Value* b, const Value* c, size_t size);
+        void (*PowReals)(Value* a, const Value* b, const Value* c, size_t size);
+
+        /** @brief a[idx] = (-1)^c[idx]. */
+        void (*Parity)(Value* a, const Value* c, size_t size);
+
+        /** @brief a[idx] = real(b[idx]). */
+        void (*ToReals)(Value* a, const Value* b, size_t size);
+
+        // Reductions of reduce kernel.
+
+        /** @brief Calculates wrapped sum of items and maximal magnitude of items. */
+        void (*SumIntegers)(const std::int64_t* items, size_t size, std::uint64_t& sum, std::uint64_t& maxMagnitude);
+        double (*SumReals)(const double* items, size_t size);
+        double (*SumIntegersAsReals)(const std::int64_t* items, size_t size);
+        double (*MultiplyReals)(const double* items, size_t size);
+        double (*MultiplyIntegersAsReals)(const std::int64_t* items, size_t size);
+
+        /** @brief output[idx] = first + step * idx for idx in [0, size). */
+        void (*FillRange)(std::int64_t first, std::int64_t step, size_t size, std::int64_t* output);
+      };
+
+      /** @brief Loops of the instruction set. nullptr if the library was built without the set. */
+      const Ops* Sse2();
+      const Ops* Avx2();
+      const Ops* Avx512();
+
+      /**
+       * @brief Returns loops of the best instruction set which is supported by CPU.
+       *
+       * The set is selected on the first call. Environment variable ABACUS_KERNEL_ISA (sse2, avx2
+       * or avx512) limits the set, e.g. for benchmarking. Sets which are not supported by CPU are
+       * never selected.
+       */
+      const Ops& Selected();
+    }
+  }
+}
@@ -0,0 +1,270 @@
+#pragma once
+
+/**
+ * Kernel loops which are compiled once per instruction set. The header is included only by
+ * KernelSse2.cpp, KernelAvx2.cpp and KernelAvx512.cpp, which are built with different flags.
+ *
+ * @note Functions have internal linkage and use only builtins and plain loops. Inline functions
+ *       and templates of other headers would be shared by all translation units, so the linker
+ *       could pick their copy which uses instructions unsupported by CPU.
+ */
+
+#include "KernelIsa.h"
+
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+
+namespace Abacus
+{
+  namespace Kernel
+  {
+    namespace Isa
+    {
+      /** @brief Number of partial results of real reductions. They are calculated in parallel by SIMD. */
+      static const size_t REDUCE_LANES = 8U;
+
+      // Overflow flags of integer operations are accumulated in the sign bit, so loops have no branches.
+
+      static bool AddIntegers(Value* a, const Value* b, const Value* c, const size_t size)
+      {
+        std::int64_t overflow = 0;
+
+        for (size_t idx = 0; idx < size; ++idx)
+        {
+          const std::int64_t l = b[idx].Integer;
+          const std::int64_t r = c[idx].Integer;
+          const std::int64_t sum = static_cast<std::int64_t>(static_cast<std::uint64_t>(l) +
+                                                             static_cast<std::uint64_t>(r));
+          overflow |= (l ^ sum) & (r ^ sum);
+          a[idx].Integer = sum;
+        }
+
+        return overflow < 0;
+      }
+
+      static bool SubIntegers(Value* a, const Value* b, const Value* c, const size_t size)
+      {
+        std::int64_t overflow = 0;
+
+        for (size_t idx = 0; idx < size; ++idx)
+        {
+          const std::int64_t l = b[idx].Integer;
+          const std::int64_t r = c[idx].Integer;
+          const std::int64_t diff = static_cast<std::int64_t>(static_cast<std::uint64_t>(l) -
+                                                              static_cast<std::uint64_t>(r));
+          overflow |= (l ^ r) & (l ^ diff);
+          a[idx].Integer = diff;
+        }
+
+        return overflow < 0;
+      }
+
+      static bool MulIntegers(Value* a, const Value* b, const Value* c, const size_t size)
+      {
+        bool overflow = false;
+
+        for (size_t idx = 0; idx < size; ++idx)
+        {
+          std::int64_t product;
+          overflow |= __builtin_mul_overflow(b[idx].Integer, c[idx].Integer, &product);
+          a[idx].Integer = product;
+        }
+
+        return overflow;
+      }
+
+      static void AddReals(Value* a, const Value* b, const Value* c, const size_t size)
+      {
+        for (size_t idx = 0; idx < size; ++idx)
+        {
+          a[idx].Real = b[idx].Real + c[idx].Real;
+        }
+      }
+
+      static void SubReals(Value* a, const Value* b, const Value* c, const size_t size)
+      {
+        for (size_t idx = 0; idx < size; ++idx)
+        {
+          a[idx].Real = b[idx].Real - c[idx].Real;
+        }
+      }
+
+      static void MulReals(Value* a, const Value* b, const Value* c, const size_t size)
+      {
+        for (size_t idx = 0; idx < size; ++idx)
+        {
+          a[idx].Real = b[idx].Real * c[idx].Real;
+        }
+      }
+
+      static void DivReals(Value* a, const Value* b, const Value* c, const size_t size)
+      {
+        for (size_t idx = 0; idx < size; ++idx)
+        {
+          a[idx].Real = b[idx].Real / c[idx].Real;
+        }
+      }
+
+      static void PowReals(Value* a, const Value* b, const Value* c, const size_t size)
+      {
+        for (size_t idx = 0; idx < size; ++idx)
+        {
+          a[idx].Real = std::pow(b[idx].Real, c[idx].Real);
+        }
+      }
+
+      static void Parity(Value* a, const Value* c, const size_t size)
+      {
+        // Doubles above 2^53 are even integers.
+        static const double MAX_ODD = 9007199254740992.0;
+
+        for (size_t idx = 0; idx < size; ++idx)
+        {
+          const double x = c[idx].Real;
+          if (std::fabs(x) < MAX_ODD && static_cast<double>(static_cast<std::int64_t>(x)) == x)
+          {
+            a[idx].Real = (static_cast<std::int64_t>(x) & 1) != 0 ? -1.0 : 1.0;
+          }
+          else
+          {
+            a[idx].Real = std::pow(-1.0, x);
+          }
+        }
+      }
+
+      static void ToReals(Value* a, const Value* b, const size_t size)
+      {
+        for (size_t idx = 0; idx < size; ++idx)
+        {
+          a[idx].Real = static_cast<double>(b[idx].Integer);
+        }
+      }
+
+      static void SumIntegers(const std::int64_t* items, const size_t size, std::uint64_t& sum, std::uint64_t& maxMagnitude)
+      {
+        std::uint64_t wrappedSum = 0U;
+        std::uint64_t magnitude = 0U;
+
+        for (size_t idx = 0; idx < size; ++idx)
+        {
+          const std::int64_t item = items[idx];
+          const std::uint64_t itemMagnitude = item < 0 ? 0U - static_cast<std::uint64_t>(item) : static_cast<std::uint64_t>(item);
+
+          wrappedSum += static_cast<std::uint64_t>(item);
+          magnitude = itemMagnitude > magnitude ? itemMagnitude : magnitude;
+        }
+
+        sum = wrappedSum;
+        maxMagnitude = magnitude;
+      }
+
+      template<typename IT>
+      static double SumLanes(const IT* items, const size_t size)
+      {
+        double lanes[REDUCE_LANES] = { };
+
+        size_t idx = 0;
+        for (; idx + REDUCE_LANES <= size; idx += REDUCE_LANES)
+        {
+          for (size_t lane = 0; lane < REDUCE_LANES; ++lane)
+          {
+            lanes[lane] += static_cast<double>(items[idx + lane]);
+          }
+        }
+
+        for (; idx < size; ++idx)
+        {
+          lanes[idx % REDUCE_LANES] += static_cast<double>(items[idx]);
+        }
+
+        double sum = 0.0;
+        for (size_t lane = 0; lane < REDUCE_LANES; ++lane)
+        {
+          sum += lanes[lane];
+        }
+
+        return sum;
+      }
+
+      template<typename IT>
+      static double MultiplyLanes(const IT* items, const size_t size)
+      {
+        double lanes[REDUCE_LANES] = { 1.0, 1.0, 1.0, 1.0, 1.0, 1.0, 1.0, 1.0 };
+
+        size_t idx = 0;
+        for (; idx + REDUCE_LANES <= size; idx += REDUCE_LANES)
+        {
+          for (size_t lane = 0; lane < REDUCE_LANES; ++lane)
+          {
+            lanes[lane] *= static_cast<double>(items[idx + lane]);
+          }
+        }
+
+        for (; idx < size; ++idx)
+        {
+          lanes[idx % REDUCE_LANES] *= static_cast<double>(items[idx]);
+        }
+
+        double product = 1.0;
+        for (size_t lane = 0; lane < REDUCE_LANES; ++lane)
+        {
+          product *= lanes[lane];
+        }
+
+        return product;
+      }
+
+      static double SumReals(const double* items, const size_t size)
+      {
+        return SumLanes(items, size);
+      }
+
+      static double SumIntegersAsReals(const std::int64_t* items, const size_t size)
+      {
+        return SumLanes(items, size);
+      }
+
+      static double MultiplyReals(const double* items, const size_t size)
+      {
+        return MultiplyLanes(items, size);
+      }
+
+      static double MultiplyIntegersAsReals(const std::int64_t* items, const size_t size)
+      {
+        return MultiplyLanes(items, size);
+      }
+
+      static void FillRange(const std::int64_t first, const std::int64_t step, const size_t size, std::int64_t* output)
+      {
+        for (size_t idx = 0; idx < size; ++idx)
+        {
+          output[idx] = static_cast<std::int64_t>(static_cast<std::uint64_t>(first) +
+                                                  static_cast<std::uint64_t>(step) * idx);
+        }
+      }
+
+      /** @brief Loops of the translation unit. It is initialized statically, so no code runs before CPU is checked. */
+      static const Ops LOOPS
+      {
+        ABACUS_KERNEL_LEVEL,
+        &AddIntegers,
+        &SubIntegers,
+        &MulIntegers,
+        &AddReals,
+        &SubReals,
+        &MulReals,
+        &DivReals,
+        &PowReals,
+        &Parity,
+        &ToReals,
+        &SumIntegers,
+        &SumReals,
+        &SumIntegersAsReals,
+        &MultiplyReals,
+        &MultiplyIntegersAsReals,
+        &FillRange
+      };
+    }
+  }
+}
@@ -0,0 +1,16 @@
+#define ABACUS_KERNEL_LEVEL Levels::SSE2
+#include "KernelLoops.h"
+
+namespace Abacus
+{
+  namespace Kernel
+  {
+    namespace Isa
+    {
+      const Ops* Sse2()
+      {
+        return &LOOPS;
+      }
+    }
+  }
+}
@@ -1,12 +1,18 @@
 #pragma once
 
 #include "ExprCalc.h"
+#include "Ast.h"
+#include "Vm.h"
 #include "Common.h"
+#include "Kernel.h"
 #include "Universal.h"
+#include "ThreadPool.h"
 
 #include <tao/pegtl.hpp>
 
 #include <future>
+#include <memory>
+#include <algorithm>
 #include <thread>
 #include <functional>
 #include <type_traits>
@@ -19,90 +25,203 @@ namespace Abacus
   {
     template<typename Input>
     void Expect(Input& input,
-                const IsTerminating& isTerminating,
-                const unsigned threads,
-                const State& variables,
-                Universal& result);
+                const Ast::Scope& scope,
+                Ast::NodePtr& result);
   }
 
   namespace Map
   {
+    /**
+     * @brief Mapper calculates map() lambda for items of a sequence.
+     *
+     * Arithmetic lambdas are calculated by the map kernel, other lambdas are calculated by batches.
+     * Short sequences are calculated item by item.
+     *
+     * @note Frame of the lambda is created once, so the lambda prologue runs once per mapper.
+     */
     template<typename IT, typename OT>
-    void MapSubSequence(
-        const char* inputCurr,
-        const size_t inputSize,
-        const IsTerminating& isTerminating,
-        const std::string& paramName,
-        const std::vector<IT>& inputSequence,
-        const size_t beginIdx,
-        const size_t endIdx,
-        std::vector<OT>& outputSequence)
+    class Mapper
     {
-      static const unsigned TERMINATE_CHECK_PERIOD = 100U;
+    public:
+      /** @param options Options of map() and reduce() operations which are nested in the lambda. */
+      Mapper(const Vm::Module& module,
+             const Vm::Function& lambda,
+             ExecControl* const control,
+             const ExecOptions& options)
+        : m_module(module),
+          m_lambda(lambda),
+          m_context { control, options, nullptr },
+          m_frame(module, lambda, m_context),
+          m_kernel(Kernel::MapKernel::IsSupported(lambda) ? new Kernel::MapKernel(lambda, m_frame) : nullptr)
+      {
+      }
 
-      for (size_t idx = beginIdx; idx < endIdx; ++idx)
+      /** @brief Calculates lambda for items [beginIdx, endIdx) of input and stores results to output[0, endIdx - beginIdx). */
+      void Map(const SharedArray<IT>& inputSequence, const size_t beginIdx, const size_t endIdx, OT* output)
       {
-        if (isTerminating != nullptr &&
-            idx % TERMINATE_CHECK_PERIOD == 0 &&
-            isTerminating())
+        static const size_t KERNEL_SLICE_SIZE = 16U * Kernel::MapKernel::BATCH_SIZE;
+        static const size_t MIN_BATCH_SIZE = 16U;
+
+        if (m_kernel == nullptr && endIdx - beginIdx < MIN_BATCH_SIZE)
         {
-          throw TerminatedError {};
+          MapItems(inputSequence, beginIdx, endIdx, output);
+          ReportDone(m_context.Control, endIdx - beginIdx);
+          return;
         }
 
-        State lambdaParams = { {paramName, Universal(inputSequence[idx])} };
+        const size_t sliceSize = m_kernel != nullptr ? KERNEL_SLICE_SIZE : Vm::Batch::SIZE;
 
-        memory_input<> input(inputCurr, inputSize, "MapSubSequence");
+        for (size_t idx = beginIdx; idx < endIdx; idx += sliceSize)
+        {
+          if (IsCancelled(m_context.Control))
+          {
+            throw TerminatedError {};
+          }
+
+          const size_t sliceEndIdx = std::min(idx + sliceSize, endIdx);
+          OT* const sliceOutput = output + (idx - beginIdx);
+
+          try
+          {
+            if (m_kernel != nullptr)
+            {
+              m_kernel->Run(inputSequence, idx, sliceEndIdx, sliceOutput);
+            }
+            else
+            {
+              MapBatch(inputSequence, idx, sliceEndIdx, sliceOutput);
+            }
+          }
+          catch (const parse_error&)
+          {
+            // Batches report errors in the order of instructions, so the slice is recalculated
+            // item by item to report the error of the first failed item.
+            MapItems(inputSequence, idx, sliceEndIdx, sliceOutput);
+          }
+
+          ReportDone(m_context.Control, sliceEndIdx - idx);
+        }
+      }
 
-        Universal callResult;
-        Expr::Expect(input, isTerminating, 1U, lambdaParams, callResult);
+    private:
+      void MapBatch(const SharedArray<IT>& inputSequence, const size_t beginIdx, const size_t endIdx, OT* output)
+      {
+        if (m_batch == nullptr)
+        {
+          m_batch.reset(new Vm::Batch(m_module, m_lambda, m_frame, m_context));
+        }
+
+        const size_t size = endIdx - beginIdx;
+
+        Universal* const parameter = m_batch->Parameter();
+        for (size_t idx = 0; idx < size; ++idx)
+        {
+          parameter[idx] = Universal(inputSequence[beginIdx + idx]);
+        }
 
-        outputSequence[idx] = GetNumber<OT>(callResult);
+        const Universal* const result = m_batch->Run(size);
+        for (size_t idx = 0; idx < size; ++idx)
+        {
+          output[idx] = GetNumber<OT>(result[idx]);
+        }
       }
+
+      void MapItems(const SharedArray<IT>& inputSequence, const size_t beginIdx, const size_t endIdx, OT* output)
+      {
+        for (size_t idx = beginIdx; idx < endIdx; ++idx)
+        {
+          if (IsCancelled(m_context.Control))
+          {
+            throw TerminatedError {};
+          }
+
+          m_frame.Registers[0] = Universal(inputSequence[idx]);
+
+          Universal callResult = Vm::Run(m_module, m_lambda, m_frame, m_context);
+
+          output[idx - beginIdx] = GetNumber<OT>(callResult);
+        }
+      }
+
+      const Vm::Module& m_module;
+      const Vm::Function& m_lambda;
+      const Vm::Context m_context;
+      Vm::Frame m_frame;
+      std::unique_ptr<Kernel::MapKernel> m_kernel;
+      std::unique_ptr<Vm::Batch> m_batch;
+    };
+
+    template<typename IT, typename OT>
+    void MapSubSequence(
+        const Vm::Module& module,
+        const Vm::Function& lambda,
+        ExecControl* const control,
+        const ExecOptions& options,
+        const SharedArray<IT>& inputSequence,
+        const size_t beginIdx,
+        const size_t endIdx,
+        std::vector<OT>& outputSequence)
+    {
+      Mapper<IT, OT> mapper(module, lambda, control, options);
+      mapper.Map(inputSequence, beginIdx, endIdx, outputSequence.data() + beginIdx);
     }
 
-    template<typename Input, typename IT, typename OT>
+    template<typename IT, typename OT>
     void MapSequence(
-        const Input& input,
-        const IsTerminating& isTerminating,
-        const unsigned threads,
-        const std::string& paramName,
-        const std::vector<IT>& inputSequence,
+        const Vm::Module& module,
+        const Vm::Function& lambda,
+        ExecControl* const control,
+        const ExecOptions& options,
+        const SharedArray<IT>& inputSequence,
         std::vector<OT>& outputSequence)
     {
       outputSequence.resize(inputSequence.size());
 
-      static const size_t MIN_JOB_SIZE = 1000U;
-
-      std::vector<std::future<void>> jobs;
-      jobs.reserve(threads);
+      const size_t batchSize = GetJobSize(options, inputSequence.size());
 
-      size_t batchSize = inputSequence.size() / threads + 1U;
-      batchSize = batchSize > MIN_JOB_SIZE ? batchSize : inputSequence.size();
+      // The pool is not created if the sequence is calculated by one job.
+      ThreadPool* const pool = batchSize < inputSequence.size() ? &ThreadPool::Instance() : nullptr;
 
-      const char* inputCurr = input.current();
-      size_t inputSize = input.size();
+      std::vector<std::future<void>> jobs;
+      jobs.reserve(inputSequence.size() / std::max<size_t>(batchSize, 1U) + 1U);
 
-      for (size_t jobBeginIdx = 0; jobBeginIdx < inputSequence.size(); jobBeginIdx += batchSize)
+      // Jobs pass the options to the lambda, so its nested operations are split into
+      // subtasks which idle workers steal.
+      const auto mapJob = [&module, &lambda, control, &inputSequence, &outputSequence, &options, batchSize](const size_t jobBeginIdx)
       {
-        size_t jobEndIdx = std::min(jobBeginIdx + batchSize, inputSequence.size());
+        const size_t jobEndIdx = std::min(jobBeginIdx + batchSize, inputSequence.size());
 
-        // The first job should be defered, other should be async
-        std::launch jobType = jobBeginIdx != 0U ?
-              std::launch::async : std::launch::deferred;
+        return [&module, &lambda, control, &inputSequence, &outputSequence, &options, jobBeginIdx, jobEndIdx]()
+        {
+          MapSubSequence(module, lambda, control, options, inputSequence, jobBeginIdx, jobEndIdx, outputSequence);
+        };
+      };
 
-        auto jobFunc = std::bind(MapSubSequence<IT, OT>,
-                                 inputCurr, inputSize, isTerminating, std::ref(paramName), std::ref(inputSequence), jobBeginIdx, jobEndIdx, std::ref(outputSequence));
+      // The first job is run by the calling thread, other jobs are run by the pool.
+      std::packaged_task<void()> firstJob(mapJob(0U));
+      jobs.push_back(firstJob.get_future());
 
-        jobs.push_back(std::async(jobType, jobFunc));
+      for (size_t jobBeginIdx = batchSize; jobBeginIdx < inputSequence.size(); jobBeginIdx += batchSize)
+      {
+        jobs.push_back(pool->Submit(mapJob(jobBeginIdx)));
       }
 
+      firstJob();
+
       bool isTerminated = false;
       std::vector<parse_error> jobErrors;
       for (auto& job : jobs)
       {
         try
         {
-          job.get();
+          if (pool != nullptr)
+          {
+            pool->Get(job);
+          }
+          else
+          {
+            job.get();
+          }
         }
         catch (const TerminatedError&)
         {
@@ -124,47 +243,48 @@ namespace Abacus
       }
     }
 
-    template<typename Input, typename OT>
+    template<typename OT>
     void MapSequence(
-        const Input& input,
-        const IsTerminating& isTerminating,
-        const unsigned threads,
-        const std::string& paramName,
+        const Vm::Module& module,
+        const Vm::Function& lambda,
+        ExecControl* const control,
+        const ExecOptions& options,
         const Universal& inputSequence,
-        std::vector<OT>& outputSequence)
+        std::vector<OT>& outputSequence,
+        const position& pos)
     {
       if (Universal::Types::INT_SEQUENCE == inputSequence.Type)
       {
-        MapSequence(input, isTerminating, threads, paramName, inputSequence.IntSequence, outputSequence);
+        MapSequence(module, lambda, control, options, inputSequence.IntSequence, outputSequence);
       }
       else if (Universal::Types::REAL_SEQUENCE == inputSequence.Type)
       {
-        MapSequence(input, isTerminating, threads, paramName, inputSequence.RealSequence, outputSequence);
+        MapSequence(module, lambda, control, options, inputSequence.RealSequence, outputSequence);
       }
       else
       {
         throw parse_error(Print("Internal runtime error. Expected sequence type but got %s",
                                 inputSequence.ToString().c_str()),
-                          input);
+                          pos);
       }
     }
 
-    template<typename Input>
-    Universal MapSequence(
-        const Input& input,
-        const IsTerminating& isTerminating,
-        const unsigned threads,
-        const std::string& paramName,
+    inline Universal MapSequence(
+        const Vm::Module& module,
+        const Vm::Function& lambda,
+        ExecControl* const control,
+        const ExecOptions& options,
         const Universal& inputSequence,
-        const Universal::Types expectedType)
+        const Universal::Types expectedType,
+        const position& pos)
     {
       Universal result;
 
       if (Universal::Types::INTEGER == expectedType)
       {
-        std::vector<int> intResult(0);
+        std::vector<Universal::Int> intResult(0);
 
-        MapSequence(input, isTerminating, threads, paramName, inputSequence, intResult);
+        MapSequence(module, lambda, control, options, inputSequence, intResult, pos);
 
         result = std::move(Universal(std::move(intResult)));
       }
@@ -172,7 +292,7 @@ namespace Abacus
       {
         std::vector<double> realResult(0);
 
-        MapSequence(input, isTerminating, threads, paramName, inputSequence, realResult);
+        MapSequence(module, lambda, control, options, inputSequence, realResult, pos);
 
         result = std::move(Universal(std::move(realResult)));
       }
@@ -180,55 +300,128 @@ namespace Abacus
       return result;
     }
 
+    /** @brief Checks that the first map() parameter is a non-empty sequence. */
+    inline void CheckSequence(const Ast::Node& node, const Universal& firstValue)
+    {
+      if (!((firstValue.Type == Universal::Types::INT_SEQUENCE && !firstValue.IntSequence.empty()) ||
+            (firstValue.Type == Universal::Types::REAL_SEQUENCE && !firstValue.RealSequence.empty())))
+      {
+        throw parse_error(Print("First map() parameter is not sequence. Param: %s",
+                                firstValue.ToString().c_str()),
+                          node.Args[0]->Pos);
+      }
+    }
+
+    /** @brief Checks that map() output fits the limit. Output of map() is stored, so its length is limited. */
+    inline void CheckSize(const Ast::Node& node, const Universal& firstValue)
+    {
+      const size_t size = firstValue.Type == Universal::Types::INT_SEQUENCE ?
+            firstValue.IntSequence.size() : firstValue.RealSequence.size();
+      if (size > MAX_SEQUENCE_SIZE)
+      {
+        throw parse_error(Print("Sequence exceeded maximal possible length. Max: %u, Requested: %zu.",
+                                static_cast<unsigned>(MAX_SEQUENCE_SIZE), size),
+                          node.Args[0]->Pos);
+      }
+    }
+
+    /** @brief Returns variant of map() lambda for items of the sequence. */
+    inline const Vm::Function& GetVariant(const Vm::Module& module, const Vm::Lambda& lambda, const Universal& firstValue)
+    {
+      return Vm::GetVariant(module,
+                            lambda,
+                            firstValue.Type == Universal::Types::INT_SEQUENCE ?
+                              Universal::Types::INTEGER : Universal::Types::REAL);
+    }
+
+    /**
+     * @brief Returns type of items of map() result.
+     *
+     * @note If the type is unknown at compile time, it is taken from the first item of sequence.
+     */
+    inline Universal::Types GetResultType(const Vm::Module& module,
+                                          const Vm::Function& function,
+                                          ExecControl* const control,
+                                          const ExecOptions& options,
+                                          const Universal& firstValue)
+    {
+      Universal::Types resultType = function.ResultType;
+      if (resultType != Universal::Types::INTEGER && resultType != Universal::Types::REAL)
+      {
+        const Vm::Context context { control, options, nullptr };
+        Vm::Frame frame(module, function, context);
+        frame.Registers[0] = firstValue.Type == Universal::Types::INT_SEQUENCE ?
+              Universal(firstValue.IntSequence.front()) : Universal(firstValue.RealSequence.front());
+
+        Universal callResult = Vm::Run(module, function, frame, context);
+        if (!callResult.IsNumber())
+        {
+          throw parse_error(Print("Expected number but labmda returned %s.",
+                                  callResult.ToString().c_str()),
+                            function.Nodes.back()->Pos);
+        }
+
+        resultType = callResult.Type;
+      }
+
+      return resultType;
+    }
+
+    inline Universal Calculate(
+        const Ast::Node& node,
+        const Vm::Module& module,
+        const Vm::Lambda& lambda,
+        ExecControl* const control,
+        const ExecOptions& options,
+        const Universal& firstValue)
+    {
+      CheckSequence(node, firstValue);
+      CheckSize(node, firstValue);
+
+      const Vm::Function& function = GetVariant(module, lambda, firstValue);
+      const Universal::Types resultType = GetResultType(module, function, control, options, firstValue);
+
+      ReportStarted(control, firstValue.Type == Universal::Types::INT_SEQUENCE ?
+                      firstValue.IntSequence.size() : firstValue.RealSequence.size());
+
+      return MapSequence(module, function, control, options, firstValue, resultType, node.Pos);
+    }
+
     template< typename Input >
     bool Parse(
             Input& input,
-            const IsTerminating& isTerminating,
-            const unsigned threads,
-            const State& variables,
-            Universal& result)
+            const Ast::Scope& scope,
+            Ast::NodePtr& result)
     {
       struct MapBegin : seq< string<'m', 'a', 'p'>, star<space>, one<'('> > { };
 
+      const position pos = input.position();
+
       if (parse<MapBegin>(input) == false)
       {
         return false;
       }
 
-      Universal firstValue;
-      Expr::Expect(input, isTerminating, threads, variables, firstValue);
+      Ast::NodePtr node = Ast::MakeNode(Ast::Node::Kinds::MAP, pos);
 
-      if (!((firstValue.Type == Universal::Types::INT_SEQUENCE && !firstValue.IntSequence.empty()) ||
-            (firstValue.Type == Universal::Types::REAL_SEQUENCE && !firstValue.RealSequence.empty())))
-      {
-        throw parse_error(Print("First map() parameter is not sequence. Param: %s",
-                                firstValue.ToString().c_str()),
-                          input);
-      }
+      Ast::NodePtr firstValue;
+      Expr::Expect(input, scope, firstValue);
+      node->Args.push_back(std::move(firstValue));
 
       ExpectComma(input);
 
-      std::string lambdaParameter = ExpectIdentifier(input);
+      std::unique_ptr<Ast::Lambda> lambda(new Ast::Lambda { Ast::Scope { false, { ExpectIdentifier(input) } }, nullptr });
 
       ExpectArrow(input);
 
-      memory_input<> inputCopy(input.current(), input.size(), "MapSequence");
-
-      // Calculate the first item of sequence
-      Universal callResult;
-      State lambdaParams = { { lambdaParameter, Universal(firstValue.IntSequence.front()) } };
-      Expr::Expect(input, isTerminating, threads, lambdaParams, callResult);
-      if (!callResult.IsNumber())
-      {
-        throw parse_error(Print("Expected number but labmda returned %s.",
-                                callResult.ToString().c_str()),
-                          input);
-      }
-
-      result = std::move(MapSequence(inputCopy, isTerminating, threads, lambdaParameter, firstValue, callResult.Type));
+      // Lambda body is parsed and compiled once and then calculated for every item of sequence.
+      Expr::Expect(input, lambda->Params, lambda->Body);
+      node->Func = std::move(lambda);
 
       ExpectClosingBracket(input);
 
+      result = std::move(node);
+
       return true;
     }
   }
@@ -0,0 +1,252 @@
+#include "Optimizer.h"
+
+#include "Common.h"
+
+#include <algorithm>
+
+namespace Abacus
+{
+  namespace Optimizer
+  {
+    static bool IsNumber(const Ast::Node& node)
+    {
+      switch (node.Kind)
+      {
+        case Ast::Node::Kinds::CONSTANT:
+          return node.Value.IsNumber();
+
+        // Lambda parameters, results of binary operations and reduce() are always numbers.
+        case Ast::Node::Kinds::PARAMETER:
+        case Ast::Node::Kinds::BINARY_OP:
+        case Ast::Node::Kinds::REDUCE:
+          return true;
+
+        default:
+          return false;
+      }
+    }
+
+    static bool IsInteger(const Ast::Node& node)
+    {
+      if (node.Kind == Ast::Node::Kinds::CONSTANT)
+      {
+        return node.Value.Type == Universal::Types::INTEGER;
+      }
+
+      if (node.Kind == Ast::Node::Kinds::BINARY_OP)
+      {
+        return (node.Operator == Ast::Operators::ADD ||
+                node.Operator == Ast::Operators::SUB ||
+                node.Operator == Ast::Operators::MUL) &&
+            IsInteger(*node.Args[0]) &&
+            IsInteger(*node.Args[1]);
+      }
+
+      return false;
+    }
+
+    static bool IsIntegerConstant(const Ast::Node& node, const Universal::Int value)
+    {
+      return node.Kind == Ast::Node::Kinds::CONSTANT &&
+          node.Value.Type == Universal::Types::INTEGER &&
+          node.Value.Integer == value;
+    }
+
+    static Universal Calculate(const Ast::Operators op, const Universal& l, const Universal& r)
+    {
+      switch (op)
+      {
+        case Ast::Operators::ADD:
+          return Add(l, r);
+        case Ast::Operators::SUB:
+          return Sub(l, r);
+        case Ast::Operators::MUL:
+          return Mul(l, r);
+        case Ast::Operators::DIV:
+          return Div(l, r);
+        case Ast::Operators::POW:
+          return Pow(l, r);
+      }
+
+      return Universal();
+    }
+
+    static Ast::NodePtr OptimizeBinaryOp(Ast::NodePtr node)
+    {
+      const Ast::Node& left = *node->Args[0];
+      const Ast::Node& right = *node->Args[1];
+
+      if (left.Kind == Ast::Node::Kinds::CONSTANT && left.Value.IsNumber() &&
+          right.Kind == Ast::Node::Kinds::CONSTANT && right.Value.IsNumber())
+      {
+        try
+        {
+          node->Value = Calculate(node->Operator, left.Value, right.Value);
+          node->Kind = Ast::Node::Kinds::CONSTANT;
+          node->Args.clear();
+
+          return node;
+        }
+        catch (const std::exception&)
+        {
+          // The operation is kept to report the error at run time.
+        }
+      }
+
+      // Identities are applied only if they keep the type of the value. Note that x + 0 is not
+      // the same as x for real x = -0.0.
+      switch (node->Operator)
+      {
+        case Ast::Operators::MUL:
+          if (IsIntegerConstant(right, 1) && IsNumber(left))
+          {
+            return std::move(node->Args[0]);
+          }
+          if (IsIntegerConstant(left, 1) && IsNumber(right))
+          {
+            return std::move(node->Args[1]);
+          }
+          break;
+
+        case Ast::Operators::ADD:
+          if (IsIntegerConstant(right, 0) && IsInteger(left))
+          {
+            return std::move(node->Args[0]);
+          }
+          if (IsIntegerConstant(left, 0) && IsInteger(right))
+          {
+            return std::move(node->Args[1]);
+          }
+          break;
+
+        case Ast::Operators::SUB:
+          if (IsIntegerConstant(right, 0) && IsNumber(left))
+          {
+            return std::move(node->Args[0]);
+          }
+          break;
+
+        default:
+          break;
+      }
+
+      return node;
+    }
+
+    /** @brief Returns number of lambda parameter uses. Nested lambdas have their own parameters. */
+    static unsigned CountParameter(const Ast::Node& node, const unsigned slot)
+    {
+      unsigned count = node.Kind == Ast::Node::Kinds::PARAMETER && node.Slot == slot ? 1U : 0U;
+
+      for (const auto& arg : node.Args)
+      {
+        count += CountParameter(*arg, slot);
+      }
+
+      return count;
+    }
+
+    static bool HasSequenceOperations(const Ast::Node& node)
+    {
+      if (node.Kind == Ast::Node::Kinds::SEQUENCE ||
+          node.Kind == Ast::Node::Kinds::MAP ||
+          node.Kind == Ast::Node::Kinds::REDUCE)
+      {
+        return true;
+      }
+
+      return std::any_of(node.Args.cbegin(),
+                         node.Args.cend(),
+                         [](const Ast::NodePtr& arg) { return HasSequenceOperations(*arg); });
+    }
+
+    /** @brief Replaces uses of lambda parameter by copies of the value tree. */
+    static Ast::NodePtr SubstituteParameter(Ast::NodePtr node, const unsigned slot, const Ast::Node& value)
+    {
+      if (node->Kind == Ast::Node::Kinds::PARAMETER && node->Slot == slot)
+      {
+        return Ast::Clone(value);
+      }
+
+      for (auto& arg : node->Args)
+      {
+        arg = SubstituteParameter(std::move(arg), slot, value);
+      }
+
+      return node;
+    }
+
+    /**
+     * @brief Fuses map(map(s, x -> f), y -> g) into map(s, x -> g(f)), so the inner sequence is not stored.
+     *
+     * @note f is calculated for every use of y, so it is fused only if y is used once or f is arithmetic.
+     */
+    static Ast::NodePtr FuseMaps(Ast::NodePtr node)
+    {
+      Ast::Node& inner = *node->Args[0];
+      const Ast::Node& innerBody = *inner.Func->Body;
+
+      // Sequences returned by the inner lambda are reported as errors by the inner map().
+      if (innerBody.Kind == Ast::Node::Kinds::SEQUENCE || innerBody.Kind == Ast::Node::Kinds::MAP)
+      {
+        return node;
+      }
+
+      // The inner lambda is not calculated if y is not used, so its errors would be lost.
+      const unsigned uses = CountParameter(*node->Func->Body, 0U);
+      if (uses == 0U || (uses > 1U && HasSequenceOperations(innerBody)))
+      {
+        return node;
+      }
+
+      Ast::NodePtr body = SubstituteParameter(std::move(node->Func->Body), 0U, innerBody);
+
+      node->Func.reset(new Ast::Lambda { inner.Func->Params, std::move(body) });
+      node->Args[0] = std::move(inner.Args[0]);
+
+      return node;
+    }
+
+    static Ast::NodePtr OptimizeNode(Ast::NodePtr node, const State& constants)
+    {
+      for (auto& arg : node->Args)
+      {
+        arg = OptimizeNode(std::move(arg), constants);
+      }
+
+      if (node->Kind == Ast::Node::Kinds::MAP && node->Args[0]->Kind == Ast::Node::Kinds::MAP)
+      {
+        node = FuseMaps(std::move(node));
+      }
+
+      if (node->Func != nullptr)
+      {
+        // Lambdas have no closure, so variables are not visible there.
+        static const State LAMBDA_CONSTANTS;
+
+        node->Func->Body = OptimizeNode(std::move(node->Func->Body), LAMBDA_CONSTANTS);
+      }
+
+      if (node->Kind == Ast::Node::Kinds::VARIABLE)
+      {
+        const auto it = constants.find(node->Name);
+        if (it != constants.cend() && it->second.IsNumber())
+        {
+          node->Kind = Ast::Node::Kinds::CONSTANT;
+          node->Value = it->second;
+        }
+      }
+      else if (node->Kind == Ast::Node::Kinds::BINARY_OP)
+      {
+        return OptimizeBinaryOp(std::move(node));
+      }
+
+      return node;
+    }
+
+    Ast::NodePtr Optimize(Ast::NodePtr tree, const State& constants)
+    {
+      return OptimizeNode(std::move(tree), constants);
+    }
+  }
+}
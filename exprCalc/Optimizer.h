@@ -0,0 +1,25 @@
+#pragma once
+
+#include "Ast.h"
+#include "ExprCalc.h"
+
+namespace Abacus
+{
+  namespace Optimizer
+  {
+    /**
+     * @brief Simplifies expression tree.
+     *
+     * Folds constant subtrees and removes operations which do not change a value (x * 1, x - 0 ...).
+     * Nested map() calls are fused into one. Lambda bodies are simplified as well.
+     *
+     * @param tree Expression tree to be simplified.
+     * @param constants Variables with values known at compile time. Only numbers are substituted.
+     *
+     * @return Simplified tree.
+     *
+     * @note Operations which fail at compile time (e.g. overflow) are kept to report errors at run time.
+     */
+    Ast::NodePtr Optimize(Ast::NodePtr tree, const State& constants);
+  }
+}
@@ -1,10 +1,21 @@
 #pragma once
 
+#include "Ast.h"
+#include "Vm.h"
 #include "Common.h"
+#include "Kernel.h"
+#include "MapParse.h"
+#include "ThreadPool.h"
 #include "Universal.h"
 
 #include <tao/pegtl.hpp>
 
+#include <memory>
+#include <future>
+#include <algorithm>
+#include <type_traits>
+#include <functional>
+
 namespace Abacus
 {
   using namespace tao::TAOCPP_PEGTL_NAMESPACE;
@@ -13,181 +24,395 @@ namespace Abacus
   {
     template<typename Input>
     void Expect(Input& input,
-                const IsTerminating& isTerminating,
-                const unsigned threads,
-                const State& variables,
-                Universal& result);
+                const Ast::Scope& scope,
+                Ast::NodePtr& result);
   }
 
   namespace Reduce
   {
 
-    template <typename Input, typename IT>
-    Universal CalculateLambda(Input& input,
-                              const std::string& firstParamName,
-                              const Universal& firstParamVal,
-                              const std::string& secondParamName,
-                              const IT secondParamVal)
+    /**
+     * @brief Calls variants of reduce() lambda which match types of parameters.
+     *
+     * @note Frame of a variant is created on its first call, so the variant prologue runs once.
+     */
+    class LambdaCaller
     {
-      State params =
+    public:
+      /** @param options Options of map() and reduce() operations which are nested in the lambda. */
+      LambdaCaller(const Vm::Module& module,
+                   const Vm::Lambda& lambda,
+                   ExecControl* const control,
+                   const ExecOptions& options)
+        : m_module(module),
+          m_lambda(lambda),
+          m_context { control, options, nullptr }
       {
-        { firstParamName, std::move(firstParamVal) },
-        { secondParamName, Universal(secondParamVal) }
-      };
+      }
 
-      Universal result;
-      Expr::Expect(input, nullptr, 1U, params, result);
-      if (!result.IsNumber())
+      template <typename IT>
+      Universal Call(const Universal& firstParamVal, const IT secondParamVal)
       {
-        throw parse_error(Print("reduce() lambda returned non number value. %s: %s, %s: %s",
-                                firstParamName.c_str(), firstParamVal.ToString().c_str(),
-                                secondParamName.c_str(), Universal(secondParamVal).ToString().c_str()),
-                          input);
-      }
+        Universal secondParam(secondParamVal);
 
-      return result;
-    }
+        const Vm::Function& function = Vm::GetVariant(m_module, m_lambda, firstParamVal.Type, secondParam.Type);
+
+        std::unique_ptr<Vm::Frame>& frame =
+            m_frames[(firstParamVal.Type == Universal::Types::REAL ? 2U : 0U) +
+                     (secondParam.Type == Universal::Types::REAL ? 1U : 0U)];
+        if (frame == nullptr)
+        {
+          frame.reset(new Vm::Frame(m_module, function, m_context));
+        }
+
+        frame->Registers[0] = firstParamVal;
+        frame->Registers[1] = std::move(secondParam);
+
+        Universal result = Vm::Run(m_module, function, *frame, m_context);
+        if (!result.IsNumber())
+        {
+          const std::vector<std::string>& names = function.Parameters;
+
+          throw parse_error(Print("reduce() lambda returned non number value. %s: %s, %s: %s",
+                                  names[0].c_str(), firstParamVal.ToString().c_str(),
+                                  names[1].c_str(), Universal(secondParamVal).ToString().c_str()),
+                            function.Nodes.back()->Pos);
+        }
+
+        return result;
+      }
 
-    template< typename IT>
-    Universal ReduceSubSequence(const char* inputCurr,
-                                const size_t inputSize,
-                                const IsTerminating& isTerminating,
-                                const std::string& firstParamName,
-                                const std::string& neutralParamName,
-                                const Universal& neutralVal,
-                                const std::vector<IT>& inputSequence,
-                                const size_t beginIdx,
-                                const size_t endIdx)
+    private:
+      const Vm::Module& m_module;
+      const Vm::Lambda& m_lambda;
+      const Vm::Context m_context;
+      std::unique_ptr<Vm::Frame> m_frames[4];
+    };
+
+    /**
+     * @brief Reduces sub-sequences of items of type T by the lambda.
+     *
+     * The lambda caller and kernels are created once, so they are reused for all sub-sequences of a job.
+     */
+    template< typename T >
+    class SubSequenceReducer
     {
-      Universal intermediateValue(neutralVal);
+    public:
+      /** @param options Options of map() and reduce() operations which are nested in the lambda. */
+      SubSequenceReducer(const Vm::Module& module,
+                         const Vm::Lambda& lambda,
+                         ExecControl* const control,
+                         const ExecOptions& options)
+        : m_module(module),
+          m_lambda(lambda),
+          m_control(control),
+          m_caller(module, lambda, control, options)
+      {
+      }
 
-      for (size_t idx = beginIdx; idx < endIdx; ++idx)
+      /** @brief Reduces items [beginIdx, endIdx) of the sequence starting from neutralVal. */
+      template< typename Sequence >
+      Universal Reduce(const Universal& neutralVal,
+                       const Sequence& inputSequence,
+                       const size_t beginIdx,
+                       const size_t endIdx)
       {
-        static const unsigned TERMINATE_CHECK_PERIOD = 100U;
+        static const size_t PROGRESS_PERIOD = 256U;
+
+        Universal intermediateValue(neutralVal);
+
+        // Progress is reported by periods, so workers rarely write the shared counter.
+        size_t reportedIdx = beginIdx;
 
-        if (idx % TERMINATE_CHECK_PERIOD == 0 &&
-            isTerminating != nullptr &&
-            isTerminating())
+        for (size_t idx = beginIdx; idx < endIdx; ++idx)
         {
-          throw TerminatedError {};
+          if (IsCancelled(m_control))
+          {
+            throw TerminatedError {};
+          }
+
+          // Type of the accumulated value can be changed by the first item, e.g. integer neutral value and real items.
+          const Kernel::ReduceKernel* const kernel = idx - beginIdx < 2U ? GetKernel(intermediateValue.Type) : nullptr;
+          if (kernel != nullptr)
+          {
+            // The kernel reports its items by slices, only preceding items are left.
+            ReportDone(m_control, idx - reportedIdx);
+            ReduceByKernel(*kernel, intermediateValue, inputSequence, idx, endIdx);
+            return intermediateValue;
+          }
+
+          intermediateValue = m_caller.Call(intermediateValue, inputSequence[idx]);
+
+          if (idx + 1U - reportedIdx == PROGRESS_PERIOD)
+          {
+            ReportDone(m_control, PROGRESS_PERIOD);
+            reportedIdx = idx + 1U;
+          }
         }
 
-        memory_input<> input(inputCurr, inputSize, "reduce() lambda");
+        ReportDone(m_control, endIdx - reportedIdx);
 
-        intermediateValue = CalculateLambda(input,
-                                            firstParamName,
-                                            intermediateValue,
-                                            neutralParamName,
-                                            inputSequence[idx]);
+        return intermediateValue;
       }
 
-      return intermediateValue;
-    }
+    private:
+      /** @brief Returns the kernel of the lambda variant for acc type or nullptr if the kernel cannot be used. */
+      const Kernel::ReduceKernel* GetKernel(const Universal::Types accType)
+      {
+        const size_t kernelIdx = accType == Universal::Types::REAL ? 1U : 0U;
 
-    template< typename IT, typename OT >
-    Universal ReduceSubSequence(const char* inputCurr,
-                                const size_t inputSize,
-                                const IsTerminating& isTerminating,
-                                const std::string& firstParamName,
-                                const std::string& neutralParamName,
-                                const Universal& neutralVal,
-                                const std::vector<Universal>& inputSequence,
-                                const size_t beginIdx,
-                                const size_t endIdx)
-    {
-      std::vector<OT> newSequence;
-      newSequence.reserve(inputSequence.size() + 1U);
+        if (!m_isKernelSelected[kernelIdx])
+        {
+          const Vm::Function& function = Vm::GetVariant(m_module,
+                                                        m_lambda,
+                                                        accType,
+                                                        std::is_same<T, double>::value ?
+                                                          Universal::Types::REAL : Universal::Types::INTEGER);
+
+          if (function.ResultType == accType && Kernel::ReduceKernel::IsSupported(function))
+          {
+            m_kernels[kernelIdx].reset(new Kernel::ReduceKernel(function));
+          }
+
+          m_isKernelSelected[kernelIdx] = true;
+        }
+
+        return m_kernels[kernelIdx].get();
+      }
 
-      for (const auto& u : inputSequence)
+      /**
+       * @brief Reduces items [beginIdx, endIdx) into acc by the kernel.
+       *
+       * Progress is reported by slices, so long ranges are watched while the kernel runs.
+       */
+      template< typename Sequence >
+      void ReduceByKernel(const Kernel::ReduceKernel& kernel,
+                          Universal& acc,
+                          const Sequence& inputSequence,
+                          const size_t beginIdx,
+                          const size_t endIdx) const
       {
-        if (u.Type == Universal::Types::INTEGER)
+        static const size_t KERNEL_SLICE_SIZE = 16U * Kernel::MapKernel::BATCH_SIZE;
+
+        for (size_t idx = beginIdx; idx < endIdx; idx += KERNEL_SLICE_SIZE)
+        {
+          if (IsCancelled(m_control))
+          {
+            throw TerminatedError {};
+          }
+
+          const size_t sliceEndIdx = std::min(idx + KERNEL_SLICE_SIZE, endIdx);
+
+          if (acc.Type == Universal::Types::INTEGER)
+          {
+            acc.Integer = kernel.Run(acc.Integer, inputSequence, idx, sliceEndIdx);
+          }
+          else
+          {
+            acc.Real = kernel.Run(acc.Real, inputSequence, idx, sliceEndIdx);
+          }
+
+          ReportDone(m_control, sliceEndIdx - idx);
+        }
+      }
+
+      const Vm::Module& m_module;
+      const Vm::Lambda& m_lambda;
+      ExecControl* const m_control;
+      LambdaCaller m_caller;
+
+      // Kernels for integer and real acc, they are selected on the first use.
+      bool m_isKernelSelected[2] = { false, false };
+      std::unique_ptr<Kernel::ReduceKernel> m_kernels[2];
+    };
+
+    /**
+     * @brief Combines results of jobs by the lambda and returns the total result.
+     *
+     * Results are combined pairwise, so a result is combined log2(n) times. Pairs of a level are
+     * combined by parallel jobs. The left result of a pair always precedes the right one.
+     *
+     * @param results Results of jobs in order of their items. They are overwritten by intermediate results.
+     */
+    inline Universal CombineResults(const Vm::Module& module,
+                                    const Vm::Lambda& lambda,
+                                    ExecControl* const control,
+                                    const ExecOptions& options,
+                                    std::vector<Universal>& results)
+    {
+      // A pair of a level is combined into its left result, so jobs of the level never share results.
+      for (size_t stride = 1U; stride < results.size(); stride *= 2U)
+      {
+        if (IsCancelled(control))
+        {
+          throw TerminatedError {};
+        }
+
+        const size_t pairs = (results.size() - stride - 1U) / (2U * stride) + 1U;
+        const size_t batchSize = GetJobSize(options, pairs);
+
+        ThreadPool* const pool = batchSize < pairs ? &ThreadPool::Instance() : nullptr;
+
+        const auto combineJob = [&module, &lambda, control, &options, &results, stride](const size_t jobBeginIdx,
+                                                                                              const size_t jobEndIdx)
+        {
+          LambdaCaller caller(module, lambda, control, options);
+
+          for (size_t pairIdx = jobBeginIdx; pairIdx < jobEndIdx; ++pairIdx)
+          {
+            const size_t leftIdx = 2U * stride * pairIdx;
+            results[leftIdx] = caller.Call(results[leftIdx], results[leftIdx + stride]);
+          }
+        };
+
+        if (pool == nullptr)
+        {
+          combineJob(0U, pairs);
+          continue;
+        }
+
+        std::vector<std::future<void>> jobs;
+        jobs.reserve(pairs / batchSize + 1U);
+
+        // The first job is run by the calling thread, other jobs are run by the pool.
+        std::packaged_task<void()> firstJob([&combineJob, batchSize]() { combineJob(0U, batchSize); });
+        jobs.push_back(firstJob.get_future());
+
+        for (size_t jobBeginIdx = batchSize; jobBeginIdx < pairs; jobBeginIdx += batchSize)
+        {
+          const size_t jobEndIdx = std::min(jobBeginIdx + batchSize, pairs);
+          jobs.push_back(pool->Submit([&combineJob, jobBeginIdx, jobEndIdx]() { combineJob(jobBeginIdx, jobEndIdx); }));
+        }
+
+        firstJob();
+
+        bool isTerminated = false;
+        std::vector<parse_error> jobErrors;
+
+        for (auto& job : jobs)
+        {
+          try
+          {
+            pool->Get(job);
+          }
+          catch (const TerminatedError&)
+          {
+            isTerminated = true;
+          }
+          catch (const parse_error& err)
+          {
+            jobErrors.push_back(err);
+          }
+        }
+
+        if (isTerminated)
         {
-          newSequence.push_back(GetValue<int>(u));
+          throw TerminatedError { };
         }
-        else
+        else if (!jobErrors.empty())
         {
-          newSequence.push_back(GetValue<double>(u));
+          throw parse_error(jobErrors.front());
         }
       }
 
-      return ReduceSubSequence(inputCurr,
-                               inputSize,
-                               isTerminating,
-                               firstParamName,
-                               neutralParamName,
-                               neutralVal,
-                               newSequence,
-                               0,
-                               newSequence.size());
+      return results.front();
     }
 
-    template< typename Input, typename IT>
-    Universal ReduceSequence(Input& input,
-                             const unsigned threads,
-                             const IsTerminating& isTerminating,
-                             const std::string& firstParamName,
-                             const std::string& secondParamName,
-                             const Universal& neutralVal,
-                             const std::vector<IT>& inputSequence)
+    /**
+     * @brief Returns number of items per reduce() job.
+     *
+     * @note Deterministic jobs have a fixed size which does not depend on other options, so real
+     *       results are the same for any number of threads and grain size.
+     */
+    inline size_t GetReduceJobSize(const ExecOptions& options, const size_t size)
     {
-      static const size_t MIN_JOB_SIZE = 1000U;
+      static const size_t DETERMINISTIC_JOB_SIZE = 16U * 1024U;
+
+      if (options.IsDeterministic)
+      {
+        return DETERMINISTIC_JOB_SIZE;
+      }
+
+      return GetJobSize(options, size);
+    }
 
-      if (inputSequence.empty())
+    /**
+     * @brief Reduces items [0, size) of a sequence by parallel jobs.
+     *
+     * @param reduceSubSequence Reduces items [beginIdx, endIdx) starting from the given value.
+     */
+    template< typename SubSequenceFunction >
+    Universal ReduceInJobs(const Vm::Module& module,
+                           const Vm::Lambda& lambda,
+                           const ExecOptions& options,
+                           ExecControl* const control,
+                           const Universal& neutralVal,
+                           const size_t size,
+                           const SubSequenceFunction& reduceSubSequence,
+                           const position& pos)
+    {
+      if (size == 0U)
       {
-        throw parse_error("reduce() requires non-empty sequence.", input);
+        throw parse_error("reduce() requires non-empty sequence.", pos);
       }
 
-      const char* inputCurr = input.current();
-      const size_t inputSize = input.size();
+      Universal firstLambdaResult = reduceSubSequence(neutralVal, 0U, 1U);
 
-      Universal firstLambdaResult = CalculateLambda(input,
-                                                    firstParamName,
-                                                    neutralVal,
-                                                    secondParamName,
-                                                    inputSequence.front());
+      const size_t batchSize = GetReduceJobSize(options, size);
 
-      std::vector<std::future<Universal>> jobs;
-      jobs.reserve(threads);
+      std::vector<Universal> jobResults;
+      jobResults.reserve(size / batchSize + 2U);
+      jobResults.push_back(std::move(firstLambdaResult));
 
-      size_t batchSize = inputSequence.size() / threads + 1U;
-      batchSize = batchSize > MIN_JOB_SIZE ? batchSize : inputSequence.size();
+      const auto reduceJob = [&reduceSubSequence, &neutralVal, size, batchSize](const size_t jobBeginIdx)
+      {
+        const size_t jobEndIdx = std::min(jobBeginIdx + batchSize, size);
+
+        return [&reduceSubSequence, &neutralVal, jobBeginIdx, jobEndIdx]()
+        {
+          return reduceSubSequence(neutralVal, jobBeginIdx, jobEndIdx);
+        };
+      };
 
       // Start from 1 because 0 item is already used for firstLambdaResult.
-      for (size_t jobBeginIdx = 1U; jobBeginIdx < inputSequence.size(); jobBeginIdx += batchSize)
+      if (options.IsSerial || 1U + batchSize >= size)
       {
-        const size_t jobEndIdx = std::min(jobBeginIdx + batchSize, inputSequence.size());
-
-        // The first job should be defered, other should be async
-        std::launch jobType = jobBeginIdx != 0U ?
-              std::launch::async : std::launch::deferred;
-
-        auto jobFunc = std::bind(ReduceSubSequence<IT>,
-                                 inputCurr,
-                                 inputSize,
-                                 std::ref(isTerminating),
-                                 std::ref(firstParamName),
-                                 std::ref(secondParamName),
-                                 std::ref(neutralVal),
-                                 std::ref(inputSequence),
-                                 jobBeginIdx,
-                                 jobEndIdx);
-
-        jobs.push_back(std::async(jobType, jobFunc));
+        // Jobs are run in order by the calling thread, so the pool is not created.
+        for (size_t jobBeginIdx = 1U; jobBeginIdx < size; jobBeginIdx += batchSize)
+        {
+          jobResults.push_back(reduceJob(jobBeginIdx)());
+        }
+
+        return CombineResults(module, lambda, control, options, jobResults);
       }
 
+      ThreadPool& pool = ThreadPool::Instance();
+
+      std::vector<std::future<Universal>> jobs;
+      jobs.reserve(size / batchSize + 1U);
+
+      // The first job is run by the calling thread, other jobs are run by the pool.
+      std::packaged_task<Universal()> firstJob(reduceJob(1U));
+      jobs.push_back(firstJob.get_future());
+
+      for (size_t jobBeginIdx = 1U + batchSize; jobBeginIdx < size; jobBeginIdx += batchSize)
+      {
+        jobs.push_back(pool.Submit(reduceJob(jobBeginIdx)));
+      }
+
+      firstJob();
+
       bool isTerminated = false;
 
       std::vector<parse_error> jobErrors;
       jobErrors.reserve(jobs.size());
 
-      std::vector<Universal> jobResults;
-      jobResults.reserve(jobs.size());
 
       for (auto& job : jobs)
       {
         try
         {
-          jobResults.push_back(job.get());
+          jobResults.push_back(pool.Get(job));
         }
         catch (const TerminatedError&)
         {
@@ -208,99 +433,253 @@ namespace Abacus
         throw parse_error(jobErrors.front());
       }
 
-      return ReduceSubSequence(inputCurr,
-                               inputSize,
-                               isTerminating,
-                               firstParamName,
-                               secondParamName,
-                               firstLambdaResult,
-                               jobResults,
-                               0,
-                               jobResults.size());
+      return CombineResults(module, lambda, control, options, jobResults);
     }
 
-    template< typename Input>
-    Universal ReduceSequence(Input& input,
-                             const unsigned threads,
-                             const IsTerminating& isTerminating,
-                             const std::string& firstParamName,
-                             const std::string& secondParamName,
+    template< typename IT >
+    Universal ReduceSequence(const Vm::Module& module,
+                             const Vm::Lambda& lambda,
+                             const ExecOptions& options,
+                             ExecControl* const control,
                              const Universal& neutralVal,
-                             const Universal& inputSequence)
+                             const SharedArray<IT>& inputSequence,
+                             const position& pos)
+    {
+      const auto reduceSubSequence =
+          [&module, &lambda, &options, control, &inputSequence](const Universal& acc, const size_t beginIdx, const size_t endIdx)
+      {
+        SubSequenceReducer<IT> reducer(module, lambda, control, options);
+        return reducer.Reduce(acc, inputSequence, beginIdx, endIdx);
+      };
+
+      return ReduceInJobs(module, lambda, options, control, neutralVal, inputSequence.size(), reduceSubSequence, pos);
+    }
+
+    /**
+     * @brief Reduces results of map() lambda for items [beginIdx, endIdx) of the map() input.
+     *
+     * @note Results are calculated and reduced by blocks, so they are never stored all together.
+     */
+    template< typename IT, typename OT >
+    Universal ReduceMappedSubSequence(const Vm::Module& module,
+                                      const Vm::Function& mapFunction,
+                                      const Vm::Lambda& lambda,
+                                      ExecControl* const control,
+                                      const ExecOptions& options,
+                                      const Universal& neutralVal,
+                                      const SharedArray<IT>& inputSequence,
+                                      const size_t beginIdx,
+                                      const size_t endIdx)
+    {
+      static const size_t BLOCK_SIZE = 16U * Kernel::MapKernel::BATCH_SIZE;
+
+      Map::Mapper<IT, OT> mapper(module, mapFunction, control, options);
+      SubSequenceReducer<OT> reducer(module, lambda, control, options);
+      std::vector<OT> items(std::min(BLOCK_SIZE, endIdx - beginIdx));
+
+      Universal intermediateValue(neutralVal);
+
+      for (size_t blockIdx = beginIdx; blockIdx < endIdx; blockIdx += BLOCK_SIZE)
+      {
+        const size_t blockSize = std::min(BLOCK_SIZE, endIdx - blockIdx);
+
+        mapper.Map(inputSequence, blockIdx, blockIdx + blockSize, items.data());
+
+        intermediateValue = reducer.Reduce(intermediateValue, items, 0U, blockSize);
+      }
+
+      return intermediateValue;
+    }
+
+    template< typename IT, typename OT >
+    Universal ReduceMappedSequence(const Vm::Module& module,
+                                   const Vm::Function& mapFunction,
+                                   const Vm::Lambda& lambda,
+                                   const ExecOptions& options,
+                                   ExecControl* const control,
+                                   const Universal& neutralVal,
+                                   const SharedArray<IT>& inputSequence,
+                                   const position& pos)
+    {
+      const auto reduceSubSequence =
+          [&module, &mapFunction, &lambda, &options, control, &inputSequence](const Universal& acc,
+                                                                                     const size_t beginIdx,
+                                                                                     const size_t endIdx)
+      {
+        return ReduceMappedSubSequence<IT, OT>(module, mapFunction, lambda, control, options,
+                                               acc, inputSequence, beginIdx, endIdx);
+      };
+
+      return ReduceInJobs(module, lambda, options, control, neutralVal, inputSequence.size(), reduceSubSequence, pos);
+    }
+
+    template< typename IT >
+    Universal ReduceMappedSequence(const Vm::Module& module,
+                                   const Vm::Function& mapFunction,
+                                   const Universal::Types mapResultType,
+                                   const Vm::Lambda& lambda,
+                                   const ExecOptions& options,
+                                   ExecControl* const control,
+                                   const Universal& neutralVal,
+                                   const SharedArray<IT>& inputSequence,
+                                   const position& pos)
+    {
+      if (mapResultType == Universal::Types::INTEGER)
+      {
+        return ReduceMappedSequence<IT, Universal::Int>(module, mapFunction, lambda, options, control,
+                                                        neutralVal, inputSequence, pos);
+      }
+
+      return ReduceMappedSequence<IT, double>(module, mapFunction, lambda, options, control,
+                                              neutralVal, inputSequence, pos);
+    }
+
+    inline Universal ReduceSequence(const Vm::Module& module,
+                                    const Vm::Lambda& lambda,
+                                    const ExecOptions& options,
+                                    ExecControl* const control,
+                                    const Universal& neutralVal,
+                                    const Universal& inputSequence,
+                                    const position& pos)
     {
       if (Universal::Types::REAL_SEQUENCE == inputSequence.Type)
       {
-        return ReduceSequence(input,
-                              threads,
-                              isTerminating,
-                              firstParamName,
-                              secondParamName,
+        return ReduceSequence(module,
+                              lambda,
+                              options,
+                              control,
                               neutralVal,
-                              inputSequence.RealSequence);
+                              inputSequence.RealSequence,
+                              pos);
       }
       else if (Universal::Types::INT_SEQUENCE == inputSequence.Type)
       {
-        return ReduceSequence(input,
-                              threads,
-                              isTerminating,
-                              firstParamName,
-                              secondParamName,
+        return ReduceSequence(module,
+                              lambda,
+                              options,
+                              control,
                               neutralVal,
-                              inputSequence.IntSequence);
+                              inputSequence.IntSequence,
+                              pos);
       }
 
-      throw parse_error("Internal runtime error.", input);
+      throw parse_error("Internal runtime error.", pos);
     }
 
-    template< typename Input >
-    bool Parse(Input& input,
-               const IsTerminating& isTerminating,
-               const unsigned threads,
-               const State& variables,
-               Universal& result)
+    inline void CheckNeutralValue(const Ast::Node& node, const Universal& neutralValue)
     {
-      struct ReduceBegin : seq<string< 'r', 'e', 'd', 'u', 'c', 'e' >, star<space>, one<'('> > { };
-
-      if (parse<ReduceBegin>(input) == false)
+      if (!neutralValue.IsNumber())
       {
-        return false;
+        throw parse_error(Print("Expected a number but actual value is %s.",
+                                neutralValue.ToString().c_str()),
+                          node.Args[1]->Pos);
       }
+    }
 
-      Universal firstParamValue;
-      Expr::Expect(input, isTerminating, threads, variables, firstParamValue);
+    inline Universal Calculate(const Ast::Node& node,
+                               const Vm::Module& module,
+                               const Vm::Lambda& lambda,
+                               ExecControl* const control,
+                               const ExecOptions& options,
+                               const Universal& firstParamValue,
+                               const Universal& secondParamValue)
+    {
       if (firstParamValue.Type != Universal::Types::INT_SEQUENCE &&
           firstParamValue.Type != Universal::Types::REAL_SEQUENCE)
       {
         throw parse_error(Print("Expected sequence. but actual value is %s", firstParamValue.ToString().c_str()),
-                          input);
+                          node.Args[0]->Pos);
       }
 
-      ExpectComma(input);
+      CheckNeutralValue(node, secondParamValue);
 
-      Universal secondParamValue;
-      Expr::Expect(input, isTerminating, threads, variables, secondParamValue);
-      if (!secondParamValue.IsNumber())
+      ReportStarted(control, firstParamValue.Type == Universal::Types::INT_SEQUENCE ?
+                      firstParamValue.IntSequence.size() : firstParamValue.RealSequence.size());
+
+      return ReduceSequence(module,
+                            lambda,
+                            options,
+                            control,
+                            secondParamValue,
+                            firstParamValue,
+                            node.Pos);
+    }
+
+    /**
+     * @brief Calculates reduce() of map() result without storing the result.
+     *
+     * @param node reduce() node, its first argument is map() node.
+     */
+    inline Universal CalculateMapped(const Ast::Node& node,
+                                     const Vm::Module& module,
+                                     const Vm::Lambda& mapLambda,
+                                     const Vm::Lambda& lambda,
+                                     ExecControl* const control,
+                                     const ExecOptions& options,
+                                     const Universal& sequenceValue,
+                                     const Universal& neutralValue)
+    {
+      Map::CheckSequence(*node.Args[0], sequenceValue);
+      CheckNeutralValue(node, neutralValue);
+
+      const Vm::Function& mapFunction = Map::GetVariant(module, mapLambda, sequenceValue);
+      const Universal::Types mapResultType = Map::GetResultType(module, mapFunction, control, options, sequenceValue);
+
+      // Items are calculated by map() and then reduced, so both operations report them.
+      ReportStarted(control, 2U * (sequenceValue.Type == Universal::Types::INT_SEQUENCE ?
+                                     sequenceValue.IntSequence.size() : sequenceValue.RealSequence.size()));
+
+      if (sequenceValue.Type == Universal::Types::INT_SEQUENCE)
       {
-        throw parse_error(Print("Expected a number but actual value is %s.",
-                                secondParamValue.ToString().c_str()),
-                          input);
+        return ReduceMappedSequence(module, mapFunction, mapResultType, lambda, options, control,
+                                    neutralValue, sequenceValue.IntSequence, node.Pos);
+      }
+
+      return ReduceMappedSequence(module, mapFunction, mapResultType, lambda, options, control,
+                                  neutralValue, sequenceValue.RealSequence, node.Pos);
+    }
+
+    template< typename Input >
+    bool Parse(Input& input,
+               const Ast::Scope& scope,
+               Ast::NodePtr& result)
+    {
+      struct ReduceBegin : seq<string< 'r', 'e', 'd', 'u', 'c', 'e' >, star<space>, one<'('> > { };
+
+      const position pos = input.position();
+
+      if (parse<ReduceBegin>(input) == false)
+      {
+        return false;
       }
 
+      Ast::NodePtr node = Ast::MakeNode(Ast::Node::Kinds::REDUCE, pos);
+
+      Ast::NodePtr firstParamValue;
+      Expr::Expect(input, scope, firstParamValue);
+      node->Args.push_back(std::move(firstParamValue));
+
+      ExpectComma(input);
+
+      Ast::NodePtr secondParamValue;
+      Expr::Expect(input, scope, secondParamValue);
+      node->Args.push_back(std::move(secondParamValue));
+
       ExpectComma(input);
       const std::string firstParamName = ExpectIdentifier(input);
       const std::string secondParamName = ExpectIdentifier(input);
       ExpectArrow(input);
 
-      result = ReduceSequence(input,
-                              threads,
-                              isTerminating,
-                              firstParamName,
-                              secondParamName,
-                              secondParamValue,
-                              firstParamValue);
+      std::unique_ptr<Ast::Lambda> lambda(new Ast::Lambda { Ast::Scope { false, { firstParamName, secondParamName } }, nullptr });
+
+      // Lambda body is parsed and compiled once and then calculated for every item of sequence.
+      Expr::Expect(input, lambda->Params, lambda->Body);
+      node->Func = std::move(lambda);
 
       ExpectClosingBracket(input);
 
+      result = std::move(node);
+
       return true;
     }
   }
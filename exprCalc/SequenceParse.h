@@ -1,10 +1,17 @@
 #pragma once
 
+#include "Ast.h"
 #include "Common.h"
+#include "KernelIsa.h"
 #include "Universal.h"
+#include "ThreadPool.h"
 
 #include <tao/pegtl.hpp>
 
+#include <future>
+#include <limits>
+#include <vector>
+
 namespace Abacus
 {
   using namespace tao::TAOCPP_PEGTL_NAMESPACE;
@@ -13,88 +20,175 @@ namespace Abacus
   {
     template<typename Input>
     void Expect(Input& input,
-                const IsTerminating& isTerminating,
-                const unsigned threads,
-                const State& variables,
-                Universal& result);
+                const Ast::Scope& scope,
+                Ast::NodePtr& result);
   }
 
   namespace Sequence
   {
-    template<typename Input>
-    bool Parse(Input& input,
-               const IsTerminating& isTerminating,
-               const unsigned threads,
-               const State& variables,
-               Universal& result)
+    inline Universal Calculate(const Ast::Node& node,
+                               const Universal& firstValue,
+                               const Universal& secondValue)
     {
-      if (!parse< one<'{'> >(input))
+      if (firstValue.Type != Universal::Types::INTEGER)
       {
-        return false;
+        throw parse_error(Print("Expected integer but actual is %s",
+                                firstValue.ToString().c_str()),
+                          node.Args[0]->Pos);
       }
 
-      Universal firstValue;
-      Expr::Expect(input, isTerminating, threads, variables, firstValue);
-      if (firstValue.Type != Universal::Types::INTEGER)
+      if (secondValue.Type != Universal::Types::INTEGER)
       {
         throw parse_error(Print("Expected integer but actual is %s",
-                                firstValue.ToString().c_str()),
-                          input);
+                                secondValue.ToString().c_str()),
+                          node.Args[1]->Pos);
       }
 
-      ExpectComma(input);
+      Universal::Int distance = 0;
+      if (__builtin_sub_overflow(secondValue.Integer, firstValue.Integer, &distance) ||
+          distance == std::numeric_limits<Universal::Int>::min())
+      {
+        throw parse_error("Sequence is too long.", node.Pos);
+      }
+
+      const Universal::Int step = distance > 0 ? 1 : -1;
+      const size_t size = static_cast<size_t>(distance > 0 ? distance : -distance) + 1U;
 
-      Universal secondValue;
+      // Items of the range are calculated by consumers, they are stored only if it is needed.
+      return Universal(SharedArray<Universal::Int>::Range(firstValue.Integer, step, size));
+    }
+
+    /**
+     * @brief Checks that a sequence which is returned to the caller fits the limit.
+     *
+     * The caller may store items of the sequence, so its length is limited as the output of map().
+     * Ranges inside of an expression are not stored, so they are not limited.
+     */
+    inline void CheckResult(const Universal& value, const position& pos)
+    {
+      const size_t size = value.Type == Universal::Types::INT_SEQUENCE ? value.IntSequence.size() :
+                          value.Type == Universal::Types::REAL_SEQUENCE ? value.RealSequence.size() : 0U;
+      if (size > MAX_SEQUENCE_SIZE)
+      {
+        throw parse_error(Print("Sequence exceeded maximal possible length. Max: %u, Requested: %zu.",
+                                static_cast<unsigned>(MAX_SEQUENCE_SIZE), size),
+                          pos);
+      }
+    }
+
+    /**
+     * @brief Returns the value with stored items if it is a range.
+     *
+     * Values which are returned to the caller are stored, so the caller never calculates their items.
+     * Items are filled by parallel jobs with loops of the instruction set selected at run time.
+     */
+    inline Universal Store(const Universal& value, ExecControl* const control, const ExecOptions& options)
+    {
+      if (value.Type != Universal::Types::INT_SEQUENCE || !value.IntSequence.IsRange())
       {
-        Expr::Expect(input, isTerminating, threads, variables, secondValue);
+        return value;
+      }
+
+      // Filling is bound by memory bandwidth, so short jobs are not worth running.
+      static const size_t MIN_JOB_SIZE = 64U * 1024U;
+      static const size_t SLICE_SIZE = 16U * 1024U;
+
+      const SharedArray<Universal::Int>& range = value.IntSequence;
+      const size_t size = range.size();
+      const size_t batchSize = std::max(GetJobSize(options, size), MIN_JOB_SIZE);
+      const Kernel::Isa::Ops& ops = Kernel::Isa::Selected();
 
-        if (secondValue.Type != Universal::Types::INTEGER)
+      std::vector<Universal::Int> items(size);
+
+      const auto fillJob = [&ops, &range, &items, control](const size_t jobBeginIdx, const size_t jobEndIdx)
+      {
+        // Termination is checked between slices.
+        for (size_t idx = jobBeginIdx; idx < jobEndIdx; idx += SLICE_SIZE)
         {
-          throw parse_error(Print("Expected integer but actual is %s",
-                                  secondValue.ToString().c_str()),
-                            input);
+          if (IsCancelled(control))
+          {
+            throw TerminatedError {};
+          }
+
+          const size_t sliceEndIdx = std::min(idx + SLICE_SIZE, jobEndIdx);
+          ops.FillRange(range[idx], range.Step(), sliceEndIdx - idx, items.data() + idx);
         }
+      };
+
+      if (batchSize >= size)
+      {
+        fillJob(0U, size);
+        return Universal(std::move(items));
       }
 
-      IgnoreSpace(input);
-      ExpectChar<'}'>(input);
+      ThreadPool& pool = ThreadPool::Instance();
 
-      const int step = secondValue.Integer > firstValue.Integer ? 1 : -1;
-      const size_t size = static_cast<unsigned>(secondValue.Integer > firstValue.Integer ?
-                              secondValue.Integer - firstValue.Integer + 1 : firstValue.Integer - secondValue.Integer + 1);
+      std::vector<std::future<void>> jobs;
+      jobs.reserve(size / batchSize + 1U);
 
-      static const size_t MAX_SEQUENCE_SIZE = 2000000U;
+      // The first job is run by the calling thread, other jobs are run by the pool.
+      std::packaged_task<void()> firstJob([&fillJob, batchSize]() { fillJob(0U, batchSize); });
+      jobs.push_back(firstJob.get_future());
 
-      if (size > MAX_SEQUENCE_SIZE)
+      for (size_t jobBeginIdx = batchSize; jobBeginIdx < size; jobBeginIdx += batchSize)
       {
-        throw parse_error(Print("Sequence exceeded maximal possible length. Max: %u, Requested: %u.",
-                                static_cast<unsigned>(MAX_SEQUENCE_SIZE), static_cast<unsigned>(size)),
-                          input);
+        const size_t jobEndIdx = std::min(jobBeginIdx + batchSize, size);
+        jobs.push_back(pool.Submit([&fillJob, jobBeginIdx, jobEndIdx]() { fillJob(jobBeginIdx, jobEndIdx); }));
       }
 
-      std::vector<int> sequence;
-      sequence.reserve(static_cast<size_t>(size));
-
-      static const unsigned TERMINATE_CHECK_PERIOD = 1000U;
+      firstJob();
 
-      for (int i = firstValue.Integer; i != secondValue.Integer; i += step)
+      bool isTerminated = false;
+      for (auto& job : jobs)
       {
-        if (isTerminating != nullptr &&
-            i % TERMINATE_CHECK_PERIOD &&
-            isTerminating())
+        try
+        {
+          pool.Get(job);
+        }
+        catch (const TerminatedError&)
         {
-          throw TerminatedError {};
+          isTerminated = true;
         }
+      }
 
-        sequence.push_back(i);
+      if (isTerminated)
+      {
+        throw TerminatedError { };
       }
 
-      sequence.push_back(secondValue.Integer);
+      return Universal(std::move(items));
+    }
 
-      result = Universal(std::move(sequence));
+    template<typename Input>
+    bool Parse(Input& input,
+               const Ast::Scope& scope,
+               Ast::NodePtr& result)
+    {
+      const position pos = input.position();
+
+      if (!parse< one<'{'> >(input))
+      {
+        return false;
+      }
+
+      Ast::NodePtr node = Ast::MakeNode(Ast::Node::Kinds::SEQUENCE, pos);
+
+      Ast::NodePtr firstValue;
+      Expr::Expect(input, scope, firstValue);
+      node->Args.push_back(std::move(firstValue));
+
+      ExpectComma(input);
+
+      Ast::NodePtr secondValue;
+      Expr::Expect(input, scope, secondValue);
+      node->Args.push_back(std::move(secondValue));
+
+      IgnoreSpace(input);
+      ExpectChar<'}'>(input);
+
+      result = std::move(node);
 
       return true;
     }
   }
 }
-
@@ -2,11 +2,18 @@
 
 #include "ExprCalc.h"
 
+#include "Ast.h"
+#include "Vm.h"
+#include "Compiler.h"
+#include "Optimizer.h"
 #include "ExprParse.h"
+#include "MapParse.h"
 #include "Universal.h"
 
+#include <memory>
 #include <string>
 #include <vector>
+#include <algorithm>
 
 #include <tao/pegtl.hpp>
 
@@ -16,6 +23,64 @@ namespace Abacus
   {
     using namespace tao::TAOCPP_PEGTL_NAMESPACE;
 
+    /** @brief Statement is a compiled 'var', 'out' or 'print' statement. */
+    struct Statement
+    {
+      enum class Kinds : unsigned char
+      {
+        ASSIGNMENT,
+        FUSED_ASSIGNMENT,
+        PRINT_EXPR,
+        PRINT_TEXT
+      };
+
+      Kinds Kind;
+
+      /** @brief Name of assigned variable or printed text. */
+      std::string Text;
+
+      /** @brief Slot of assigned variable. */
+      unsigned Slot;
+
+      /** @brief Compiled expression. It is empty for PRINT_TEXT and FUSED_ASSIGNMENT. */
+      Vm::Module Module;
+
+      /** @brief Variable read by the statement and the preceding statement which assigns it. */
+      struct Input
+      {
+        unsigned Slot;
+        size_t Statement;
+      };
+
+      /** @brief Variables assigned by preceding statements. Other variables are taken from the program state. */
+      std::vector<Input> Inputs = {};
+    };
+
+    /** @brief Globals are shared by all statements of a program at compile time. */
+    struct Globals
+    {
+      /** @brief Names of variables by slots. */
+      std::vector<std::string> Variables;
+
+      /** @brief Numbers assigned by previous statements. */
+      State Constants;
+    };
+
+    inline unsigned VariableSlot(Globals& globals, const std::string& name)
+    {
+      std::vector<std::string>& variables = globals.Variables;
+
+      const auto it = std::find(variables.cbegin(), variables.cend(), name);
+      if (it != variables.cend())
+      {
+        return static_cast<unsigned>(it - variables.cbegin());
+      }
+
+      variables.push_back(name);
+
+      return static_cast<unsigned>(variables.size() - 1U);
+    }
+
     template< typename Rule >
     struct IdentifierAction : nothing<Rule> { };
 
@@ -39,11 +104,8 @@ namespace Abacus
                 template< typename... > class Control,
                 typename Input >
       static bool match(Input& input,
-                        const IsTerminating& isTerminating,
-                        const unsigned threads,
-                        const State& variables,
-                        std::vector<std::string>&,
-                        State& newVariables)
+                        std::vector<Statement>& statements,
+                        Globals& globals)
       {
         struct VarDefBegin : seq< star<space>, string<'v', 'a', 'r'>, plus<space> > {};
 
@@ -62,10 +124,28 @@ namespace Abacus
 
         ExpectChar<'='>(input);
 
-        Universal variableValue;
-        Expr::Expect(input, isTerminating, threads, variables, variableValue);
+        Ast::NodePtr expression;
+        Expr::Expect(input, Ast::Scope { true, { } }, expression);
 
-        newVariables[variableName] = variableValue;
+        expression = Optimizer::Optimize(std::move(expression), globals.Constants);
+
+        // Numbers assigned by the statement are folded into the following statements.
+        if (expression->Kind == Ast::Node::Kinds::CONSTANT && expression->Value.IsNumber())
+        {
+          globals.Constants[variableName] = expression->Value;
+        }
+        else
+        {
+          globals.Constants.erase(variableName);
+        }
+
+        Vm::Module module = Compiler::Compile(std::move(expression), globals.Variables);
+
+        statements.push_back(Statement {
+                               Statement::Kinds::ASSIGNMENT,
+                               variableName,
+                               VariableSlot(globals, variableName),
+                               std::move(module) });
 
         return true;
       }
@@ -81,11 +161,8 @@ namespace Abacus
                 template< typename... > class Control,
                 typename Input >
       static bool match(Input& input,
-                        const IsTerminating& isTerminating,
-                        const unsigned threads,
-                        const State& variables,
-                        std::vector<std::string>& output,
-                        State&)
+                        std::vector<Statement>& statements,
+                        Globals& globals)
       {
         struct PrintExprBegin : seq< star<space>, string<'o', 'u', 't'>, plus<space> > { };
 
@@ -94,10 +171,16 @@ namespace Abacus
           return false;
         }
 
-        Universal expressionValue;
-        Expr::Expect(input, isTerminating, threads, variables, expressionValue);
+        Ast::NodePtr expression;
+        Expr::Expect(input, Ast::Scope { true, { } }, expression);
+
+        expression = Optimizer::Optimize(std::move(expression), globals.Constants);
 
-        output.push_back(expressionValue.ToString());
+        statements.push_back(Statement {
+                               Statement::Kinds::PRINT_EXPR,
+                               std::string(),
+                               0U,
+                               Compiler::Compile(std::move(expression), globals.Variables) });
 
         return true;
       }
@@ -129,11 +212,8 @@ namespace Abacus
           template< typename... > class Control,
           typename Input >
       static bool match(Input& input,
-                        const IsTerminating&,
-                        const unsigned,
-                        const State&,
-                        std::vector<std::string>& output,
-                        State&)
+                        std::vector<Statement>& statements,
+                        Globals& /*globals*/)
       {
         struct PrintTextBegin : seq< star<space>, string<'p', 'r', 'i', 'n', 't'>, plus<space> > { };
 
@@ -152,22 +232,204 @@ namespace Abacus
 
         ExpectChar<'"'>(input);
 
-        output.push_back(text);
+        statements.push_back(Statement { Statement::Kinds::PRINT_TEXT, text, 0U, Vm::Module() });
 
         return true;
       }
     };
 
+    /**
+     * @brief Parses and compiles statement.
+     *
+     * @param globals Variables and constants of previous statements. It is updated by the statement.
+     */
     template<typename Input>
     bool Parse(Input& input,
-               const IsTerminating& isTerminating,
-               const unsigned threads,
-               const State& variables,
-               std::vector<std::string>& output,
-               State& newVariables)
+               std::vector<Statement>& statements,
+               Globals& globals)
     {
       struct Statement : sor<Assignment, PrintExpr, PrintText> { };
-      return parse<Statement>(input, isTerminating, threads, variables, output, newVariables);
+      return parse<Statement>(input, statements, globals);
+    }
+
+    /** @brief Returns number of uses of the variable in the tree. */
+    inline unsigned CountVariable(const Ast::Node& node, const std::string& name)
+    {
+      unsigned count = node.Kind == Ast::Node::Kinds::VARIABLE && node.Name == name ? 1U : 0U;
+
+      for (const auto& arg : node.Args)
+      {
+        count += CountVariable(*arg, name);
+      }
+
+      return count;
+    }
+
+    /** @brief Returns map() or reduce() node whose sequence is the variable. */
+    inline Ast::Node* FindSequenceUse(Ast::Node& node, const std::string& name)
+    {
+      if ((node.Kind == Ast::Node::Kinds::MAP || node.Kind == Ast::Node::Kinds::REDUCE) &&
+          node.Args[0]->Kind == Ast::Node::Kinds::VARIABLE &&
+          node.Args[0]->Name == name)
+      {
+        return &node;
+      }
+
+      for (const auto& arg : node.Args)
+      {
+        Ast::Node* use = FindSequenceUse(*arg, name);
+        if (use != nullptr)
+        {
+          return use;
+        }
+      }
+
+      return nullptr;
+    }
+
+    /**
+     * @brief Fuses map() assigned to a variable into the next statement if it is the only use of the variable.
+     *
+     *   var m = map(s, x -> f)
+     *   var r = map(m, y -> g)
+     *
+     * is calculated as map(s, x -> g(f)), so the sequence m is never stored. The statement of m becomes
+     * FUSED_ASSIGNMENT which is not run, so m is not returned by the program.
+     *
+     * @param variables Names of variables by slots. Slots are not changed.
+     */
+    inline void Fuse(std::vector<Statement>& statements, std::vector<std::string>& variables)
+    {
+      for (size_t idx = 0; idx + 1U < statements.size(); ++idx)
+      {
+        Statement& producer = statements[idx];
+        Statement& consumer = statements[idx + 1U];
+
+        if (producer.Kind != Statement::Kinds::ASSIGNMENT ||
+            producer.Module.Tree->Kind != Ast::Node::Kinds::MAP ||
+            consumer.Kind == Statement::Kinds::PRINT_TEXT)
+        {
+          continue;
+        }
+
+        const std::string& name = producer.Text;
+
+        // The map() is moved to the next statement, so it should not depend on the previous value of the variable.
+        if (CountVariable(*producer.Module.Tree, name) != 0U ||
+            CountVariable(*consumer.Module.Tree, name) != 1U)
+        {
+          continue;
+        }
+
+        const bool isUsedLater = std::any_of(statements.cbegin() + idx + 2U,
+                                             statements.cend(),
+                                             [&name](const Statement& statement)
+        {
+          return statement.Kind != Statement::Kinds::PRINT_TEXT && CountVariable(*statement.Module.Tree, name) != 0U;
+        });
+
+        Ast::Node* use = FindSequenceUse(*consumer.Module.Tree, name);
+
+        if (isUsedLater || use == nullptr)
+        {
+          continue;
+        }
+
+        // Constants were folded when the statements were parsed.
+        static const State NO_CONSTANTS;
+
+        use->Args[0] = Ast::Clone(*producer.Module.Tree);
+        consumer.Module = Compiler::Compile(Optimizer::Optimize(std::move(consumer.Module.Tree), NO_CONSTANTS),
+                                            variables);
+
+        producer.Kind = Statement::Kinds::FUSED_ASSIGNMENT;
+        producer.Module = Vm::Module();
+      }
+    }
+
+    /**
+     * @brief Binds variables read by statements to the preceding statements which assign them.
+     *
+     * Every statement has its own value, so a statement depends only on the statements which it reads.
+     *
+     * @param slotsNumber Number of variables of the program.
+     */
+    inline void Bind(std::vector<Statement>& statements, const size_t slotsNumber)
+    {
+      static const size_t UNASSIGNED = static_cast<size_t>(-1);
+
+      std::vector<size_t> assignments(slotsNumber, UNASSIGNED);
+
+      for (size_t idx = 0; idx < statements.size(); ++idx)
+      {
+        Statement& statement = statements[idx];
+        statement.Inputs.clear();
+
+        for (const Vm::Function& function : statement.Module.Functions)
+        {
+          for (const Vm::Instruction& instr : function.Code)
+          {
+            if (instr.Op != Vm::OpCode::LOAD_VARIABLE || assignments[instr.B] == UNASSIGNED)
+            {
+              continue;
+            }
+
+            const bool isBound = std::any_of(statement.Inputs.cbegin(),
+                                             statement.Inputs.cend(),
+                                             [&instr](const Statement::Input& input) { return input.Slot == instr.B; });
+            if (!isBound)
+            {
+              statement.Inputs.push_back(Statement::Input { instr.B, assignments[instr.B] });
+            }
+          }
+        }
+
+        // The statement reads the previous value of the variable which it assigns.
+        if (statement.Kind == Statement::Kinds::ASSIGNMENT)
+        {
+          assignments[statement.Slot] = idx;
+        }
+      }
+    }
+
+    /**
+     * @brief Runs compiled statement.
+     *
+     * @param variables Values of variables by slots. A slot is nullptr if the variable is not defined.
+     * @param value Value assigned by the statement.
+     * @param output Output of 'out' and 'print' statements.
+     */
+    inline void Run(const Statement& statement,
+                    ExecControl* const control,
+                    const ExecOptions& options,
+                    const std::vector<const Universal*>& variables,
+                    Universal& value,
+                    std::string& output)
+    {
+      if (statement.Kind == Statement::Kinds::PRINT_TEXT)
+      {
+        output = statement.Text;
+        return;
+      }
+
+      // The value is calculated by the next statement.
+      if (statement.Kind == Statement::Kinds::FUSED_ASSIGNMENT)
+      {
+        return;
+      }
+
+      const Vm::Context context { control, options, &variables };
+      Universal result = Vm::Calculate(statement.Module, context);
+
+      if (statement.Kind != Statement::Kinds::PRINT_EXPR)
+      {
+        Sequence::CheckResult(result, statement.Module.Tree->Pos);
+        value = Sequence::Store(result, control, options);
+      }
+      else
+      {
+        output = result.ToString();
+      }
     }
   }
 }
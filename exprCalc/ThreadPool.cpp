@@ -0,0 +1,194 @@
+#include "ThreadPool.h"
+
+#include <algorithm>
+#include <iterator>
+
+namespace Abacus
+{
+  /** @brief Pool and deque of the current worker thread. */
+  static thread_local const ThreadPool* t_pool = nullptr;
+  static thread_local size_t t_queueIdx = 0U;
+
+  /** @brief Level of the task which is run by the current thread. It is 0 outside of tasks. */
+  static thread_local unsigned t_level = 0U;
+
+  ThreadPool& ThreadPool::Instance()
+  {
+    static ThreadPool pool(std::max(std::thread::hardware_concurrency(), 2U) - 1U);
+
+    return pool;
+  }
+
+  ThreadPool::ThreadPool(const unsigned workersNumber)
+    : m_nextQueueIdx(0U),
+      m_pending(0U),
+      m_pushed(0U),
+      m_waiting(0U),
+      m_isStopping(false)
+  {
+    const unsigned queuesNumber = std::max(workersNumber, 1U);
+
+    m_queues.reserve(queuesNumber);
+    for (unsigned idx = 0; idx < queuesNumber; ++idx)
+    {
+      m_queues.emplace_back(new Queue());
+    }
+
+    m_threads.reserve(queuesNumber);
+    for (unsigned idx = 0; idx < queuesNumber; ++idx)
+    {
+      m_threads.emplace_back(&ThreadPool::Work, this, idx);
+    }
+  }
+
+  ThreadPool::~ThreadPool()
+  {
+    {
+      std::lock_guard<std::mutex> lock(m_mutex);
+      m_isStopping = true;
+    }
+
+    m_wakeup.notify_all();
+
+    for (auto& thread : m_threads)
+    {
+      thread.join();
+    }
+  }
+
+  unsigned ThreadPool::NestedLevel()
+  {
+    return t_level + 1U;
+  }
+
+  void ThreadPool::Push(std::function<void()> job)
+  {
+    const size_t queueIdx = t_pool == this ?
+          t_queueIdx : m_nextQueueIdx.fetch_add(1U, std::memory_order_relaxed) % m_queues.size();
+
+    // The counter is increased first, so it never underflows when the task is taken at once.
+    {
+      std::lock_guard<std::mutex> lock(m_mutex);
+      ++m_pending;
+    }
+
+    {
+      Queue& queue = *m_queues[queueIdx];
+      std::lock_guard<std::mutex> lock(queue.Mutex);
+      queue.Tasks.push_back(Task { std::move(job), NestedLevel() });
+    }
+
+    m_wakeup.notify_one();
+
+    // Threads in Get() see the number of pushed tasks change after the task is queued, so they can take it.
+    bool isWaiting = false;
+    {
+      std::lock_guard<std::mutex> lock(m_mutex);
+      ++m_pushed;
+      isWaiting = m_waiting != 0U;
+    }
+
+    if (isWaiting)
+    {
+      m_finished.notify_all();
+    }
+  }
+
+  bool ThreadPool::Pop(Task& task, const unsigned minLevel)
+  {
+    if (m_pending == 0U)
+    {
+      return false;
+    }
+
+    const bool isWorker = t_pool == this;
+    const size_t firstIdx = isWorker ? t_queueIdx : 0U;
+
+    const auto isAllowed = [minLevel](const Task& queued) { return queued.Level >= minLevel; };
+
+    for (size_t shift = 0; shift < m_queues.size(); ++shift)
+    {
+      const size_t queueIdx = (firstIdx + shift) % m_queues.size();
+      Queue& queue = *m_queues[queueIdx];
+
+      std::lock_guard<std::mutex> lock(queue.Mutex);
+
+      // The worker continues its newest task, thieves take the oldest tasks which are usually the biggest.
+      if (isWorker && queueIdx == t_queueIdx)
+      {
+        const auto found = std::find_if(queue.Tasks.rbegin(), queue.Tasks.rend(), isAllowed);
+        if (found == queue.Tasks.rend())
+        {
+          continue;
+        }
+
+        task = std::move(*found);
+        queue.Tasks.erase(std::next(found).base());
+      }
+      else
+      {
+        const auto found = std::find_if(queue.Tasks.begin(), queue.Tasks.end(), isAllowed);
+        if (found == queue.Tasks.end())
+        {
+          continue;
+        }
+
+        task = std::move(*found);
+        queue.Tasks.erase(found);
+      }
+
+      --m_pending;
+
+      return true;
+    }
+
+    return false;
+  }
+
+  bool ThreadPool::RunPendingTask(const unsigned minLevel)
+  {
+    Task task;
+    if (!Pop(task, minLevel))
+    {
+      return false;
+    }
+
+    const unsigned level = t_level;
+    t_level = task.Level;
+
+    task.Run();
+
+    t_level = level;
+
+    // Threads which wait for the task result check it under the mutex.
+    {
+      std::lock_guard<std::mutex> lock(m_mutex);
+    }
+
+    m_finished.notify_all();
+
+    return true;
+  }
+
+  void ThreadPool::Work(const size_t queueIdx)
+  {
+    t_pool = this;
+    t_queueIdx = queueIdx;
+
+    for (;;)
+    {
+      if (RunPendingTask(0U))
+      {
+        continue;
+      }
+
+      std::unique_lock<std::mutex> lock(m_mutex);
+      m_wakeup.wait(lock, [this]() { return m_isStopping || m_pending != 0U; });
+
+      if (m_isStopping && m_pending == 0U)
+      {
+        return;
+      }
+    }
+  }
+}
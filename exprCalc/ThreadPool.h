@@ -0,0 +1,137 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <type_traits>
+#include <vector>
+
+namespace Abacus
+{
+  /**
+   * @brief ThreadPool runs tasks on persistent worker threads.
+   *
+   * Every worker has its own deque of tasks. A worker runs the newest task of its deque and steals
+   * the oldest tasks of other deques when its deque is empty. Tasks submitted by other threads are
+   * distributed over the deques.
+   *
+   * @note A thread which waits for a task result runs pending tasks meanwhile, so tasks can wait
+   *       for their own subtasks without blocking workers. It runs only tasks which are nested deeper
+   *       than its current task, so the nesting of waits is limited by the nesting of tasks.
+   */
+  class ThreadPool
+  {
+  public:
+    /** @brief Returns process-wide pool. It has a worker per CPU core except the core of the caller. */
+    static ThreadPool& Instance();
+
+    explicit ThreadPool(unsigned workersNumber);
+    ~ThreadPool();
+
+    ThreadPool(const ThreadPool&) = delete;
+    ThreadPool& operator=(const ThreadPool&) = delete;
+
+    unsigned WorkersNumber() const { return static_cast<unsigned>(m_threads.size()); }
+
+    /** @brief Submits job to be run by a worker. Exceptions of the job are passed by the future. */
+    template<typename Job>
+    std::future<typename std::result_of<Job()>::type> Submit(Job job)
+    {
+      typedef typename std::result_of<Job()>::type Result;
+
+      const auto task = std::make_shared<std::packaged_task<Result()>>(std::move(job));
+      std::future<Result> result = task->get_future();
+
+      Push([task]() { (*task)(); });
+
+      return result;
+    }
+
+    /** @brief Waits for the result and runs pending nested tasks meanwhile. */
+    template<typename T>
+    T Get(std::future<T>& future)
+    {
+      const unsigned minLevel = NestedLevel();
+
+      while (!IsReady(future))
+      {
+        // Tasks which are pushed after the check wake the thread, so they are not missed.
+        const size_t pushed = m_pushed;
+
+        if (!RunPendingTask(minLevel))
+        {
+          std::unique_lock<std::mutex> lock(m_mutex);
+
+          ++m_waiting;
+          m_finished.wait(lock, [this, pushed, &future]() { return m_pushed != pushed || IsReady(future); });
+          --m_waiting;
+        }
+      }
+
+      return future.get();
+    }
+
+  private:
+    struct Task
+    {
+      std::function<void()> Run;
+
+      /** @brief Nesting level. Tasks submitted by a task of level N have level N + 1. */
+      unsigned Level;
+    };
+
+    struct Queue
+    {
+      std::mutex Mutex;
+      std::deque<Task> Tasks;
+    };
+
+    template<typename T>
+    static bool IsReady(const std::future<T>& future)
+    {
+      return future.wait_for(std::chrono::seconds(0)) == std::future_status::ready;
+    }
+
+    /** @brief Returns level of tasks which are submitted by the current thread. */
+    static unsigned NestedLevel();
+
+    void Push(std::function<void()> job);
+
+    /**
+     * @brief Takes a task from the deque of the current worker or steals it from other deques.
+     *
+     * @param minLevel Tasks of lower levels are skipped.
+     */
+    bool Pop(Task& task, unsigned minLevel);
+
+    /** @brief Runs one pending task of at least the given level. Returns false if there are no such tasks. */
+    bool RunPendingTask(unsigned minLevel);
+
+    void Work(size_t queueIdx);
+
+    std::vector<std::unique_ptr<Queue>> m_queues;
+    std::vector<std::thread> m_threads;
+
+    /** @brief Next deque for tasks submitted by threads which are not workers. They are distributed round-robin. */
+    std::atomic<size_t> m_nextQueueIdx;
+
+    /** @brief Mutex of conditions. The numbers of pending and pushed tasks are increased under it. */
+    std::mutex m_mutex;
+
+    /** @brief Idle workers wait for pending tasks. */
+    std::condition_variable m_wakeup;
+
+    /** @brief Threads in Get() wait for finished or pushed tasks. */
+    std::condition_variable m_finished;
+
+    std::atomic<size_t> m_pending;
+    std::atomic<size_t> m_pushed;
+    size_t m_waiting;
+    bool m_isStopping;
+  };
+}
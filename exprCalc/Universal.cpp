@@ -21,96 +21,11 @@ namespace Abacus
     "REAL_SEQUENCE"
   };
 
-  Universal::Universal(const Universal &other)
-    : Type(Types::INVALID)
+  void ThrowOverflow()
   {
-    switch(other.Type)
-    {
-      case Types::INTEGER:
-        Integer = other.Integer;
-        Type = other.Type;
-        break;
-      case Types::REAL:
-        Real = other.Real;
-        Type = other.Type;
-        break;
-      case Types::INT_SEQUENCE:
-        new (&IntSequence) decltype(IntSequence)(other.IntSequence);
-        Type = other.Type;
-        break;
-      case Types::REAL_SEQUENCE:
-        new (&RealSequence) decltype(RealSequence)(other.RealSequence);
-        Type = other.Type;
-        break;
-      default:
-        Type = Types::INVALID;
-    }
-  }
-
-  Universal::Universal(Universal &&other)
-    : Type(Types::INVALID)
-  {
-    switch(other.Type)
-    {
-      case Types::INTEGER:
-        Integer = other.Integer;
-        Type = other.Type;
-        break;
-      case Types::REAL:
-        Real = other.Real;
-        Type = other.Type;
-        break;
-      case Types::INT_SEQUENCE:
-        new (&IntSequence) decltype(IntSequence)(std::move(other.IntSequence));
-        Type = other.Type;
-        break;
-      case Types::REAL_SEQUENCE:
-        new (&RealSequence) decltype(RealSequence)(std::move(other.RealSequence));
-        Type = other.Type;
-        break;
-      default:
-        Type = Types::INVALID;
-    }
-
-    other.Type = Types::INVALID;
-  }
-
-  Universal::~Universal()
-  {
-    switch(Type)
-    {
-      case Types::INT_SEQUENCE:
-        IntSequence.~IntArray();
-        break;
-      case Types::REAL_SEQUENCE:
-        RealSequence.~RealArray();
-        break;
-      default:
-        break;
-    }
-
-    Type = Types::INVALID;
-  }
-
-  Universal& Universal::operator=(const Universal& other)
-  {
-    this->~Universal();
-
-    new (this) Universal(other);
-
-    return *this;
+    throw parse_error("Overflow", {});
   }
 
-  Universal& Universal::operator=(Universal&& other)
-  {
-    this->~Universal();
-
-    new (this) Universal(std::move(other));
-
-    return *this;
-  }
-
-
   std::string Universal::ToString() const
   {
     if (Type == Types::INTEGER)
@@ -153,18 +68,11 @@ namespace Abacus
   };
 
   template <>
-  struct Multiply<int, int>
+  struct Multiply<Universal::Int, Universal::Int>
   {
-    static Universal Func(const int& l, const int& r)
+    static Universal Func(const Universal::Int& l, const Universal::Int& r)
     {
-      int m = l * r;
-
-      if (r != 0 && m / r != l)
-      {
-        throw parse_error("Overflow", {});
-      }
-
-      return Universal(m);
+      return Universal(MulIntegers(l, r));
     }
   };
 
@@ -178,17 +86,11 @@ namespace Abacus
   };
 
   template <>
-  struct Sum<int, int>
+  struct Sum<Universal::Int, Universal::Int>
   {
-    static Universal Func(const int& l, const int& r)
+    static Universal Func(const Universal::Int& l, const Universal::Int& r)
     {
-      if (((r > 0) && (l > INT_MAX - r)) ||
-          ((r < 0) && (l < INT_MIN - r)))
-      {
-        throw parse_error("Overflow", {});
-      }
-
-      return Universal(l + r);
+      return Universal(AddIntegers(l, r));
     }
   };
 
@@ -202,17 +104,11 @@ namespace Abacus
   };
 
   template <>
-  struct Subtract<int, int>
+  struct Subtract<Universal::Int, Universal::Int>
   {
-    static Universal Func(const int& l, const int& r)
+    static Universal Func(const Universal::Int& l, const Universal::Int& r)
     {
-      if (((r > 0) && (l < INT_MIN + r)) ||
-          ((r < 0) && (l > INT_MAX + r)))
-      {
-        throw parse_error("Overflow", {});
-      }
-
-      return Universal(l - r);
+      return Universal(SubIntegers(l, r));
     }
   };
 
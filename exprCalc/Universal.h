@@ -1,13 +1,196 @@
 #pragma once
 
+#include <new>
+#include <mutex>
+#include <atomic>
+#include <algorithm>
 #include <string>
 #include <vector>
+#include <cstdint>
 #include <utility>
 #include <stdexcept>
 
 namespace Abacus
 {
-  // TODO: optimize Universal (move semantic and minimize its size).
+  /** @brief Stores items of progression first, first + step, ... to output[0, size). */
+  template<typename T>
+  void FillRange(const T first, const T step, const size_t size, T* output)
+  {
+    for (size_t idx = 0; idx < size; ++idx)
+    {
+      output[idx] = static_cast<T>(first + step * static_cast<T>(idx));
+    }
+  }
+
+  /**
+   * @brief SharedArray is an immutable reference counted array.
+   *
+   * Copies of SharedArray share the same items, so copying is O(1). Items are never modified
+   * after construction, a changed sequence is built as a new array.
+   *
+   * Array can be an arithmetic progression with step 1 or -1. Its items are calculated by index
+   * and they are stored only if Items() is called.
+   */
+  template<typename T>
+  class SharedArray
+  {
+  public:
+    typedef T value_type;
+
+    SharedArray() : m_buffer(nullptr) { }
+
+    explicit SharedArray(std::vector<T>&& items)
+      : m_buffer(new Buffer { { 1U }, false, T(), T(), items.size(), { }, std::move(items) })
+    {
+    }
+
+    static SharedArray Range(const T first, const T step, const size_t size)
+    {
+      SharedArray range;
+      range.m_buffer = new Buffer { { 1U }, true, first, step, size, { }, { } };
+
+      return range;
+    }
+
+    SharedArray(const SharedArray& other) : m_buffer(other.m_buffer)
+    {
+      if (m_buffer != nullptr)
+      {
+        m_buffer->RefCount.fetch_add(1U, std::memory_order_relaxed);
+      }
+    }
+
+    SharedArray(SharedArray&& other) : m_buffer(other.m_buffer)
+    {
+      other.m_buffer = nullptr;
+    }
+
+    SharedArray& operator=(const SharedArray& other)
+    {
+      SharedArray(other).Swap(*this);
+      return *this;
+    }
+
+    SharedArray& operator=(SharedArray&& other)
+    {
+      SharedArray(std::move(other)).Swap(*this);
+      return *this;
+    }
+
+    ~SharedArray()
+    {
+      if (m_buffer != nullptr && m_buffer->RefCount.fetch_sub(1U, std::memory_order_acq_rel) == 1U)
+      {
+        delete m_buffer;
+      }
+    }
+
+    void Swap(SharedArray& other)
+    {
+      std::swap(m_buffer, other.m_buffer);
+    }
+
+    /** @brief Returns stored items. Items of range are calculated on the first call. */
+    const std::vector<T>& Items() const
+    {
+      static const std::vector<T> EMPTY;
+
+      if (m_buffer == nullptr)
+      {
+        return EMPTY;
+      }
+
+      if (m_buffer->IsRange)
+      {
+        Buffer& buffer = *m_buffer;
+
+        std::call_once(buffer.Materialized, [&buffer]()
+        {
+          buffer.Items.resize(buffer.Size);
+          FillRange(buffer.First, buffer.Step, buffer.Size, buffer.Items.data());
+        });
+      }
+
+      return m_buffer->Items;
+    }
+
+    bool IsRange() const { return m_buffer != nullptr && m_buffer->IsRange; }
+
+    /** @brief Returns difference of neighbour items of range. */
+    T Step() const { return m_buffer->Step; }
+
+    /** @brief Copies items [beginIdx, endIdx) to output. Items of range are calculated, not stored. */
+    void Copy(const size_t beginIdx, const size_t endIdx, T* output) const
+    {
+      if (m_buffer->IsRange)
+      {
+        const T first = RangeItem(*m_buffer, beginIdx);
+        const T step = m_buffer->Step;
+
+        for (size_t idx = 0; idx < endIdx - beginIdx; ++idx)
+        {
+          output[idx] = static_cast<T>(first + step * static_cast<T>(idx));
+        }
+      }
+      else
+      {
+        std::copy(m_buffer->Items.cbegin() + beginIdx, m_buffer->Items.cbegin() + endIdx, output);
+      }
+    }
+
+    size_t size() const { return m_buffer != nullptr ? m_buffer->Size : 0U; }
+    bool empty() const { return size() == 0U; }
+    T front() const { return (*this)[0]; }
+    T back() const { return (*this)[size() - 1U]; }
+
+    T operator[](const size_t idx) const
+    {
+      return m_buffer->IsRange ? RangeItem(*m_buffer, idx) : m_buffer->Items[idx];
+    }
+
+    bool operator==(const SharedArray& other) const
+    {
+      if (m_buffer == other.m_buffer)
+      {
+        return true;
+      }
+
+      if (IsRange() && other.IsRange())
+      {
+        return size() == other.size() &&
+            (empty() || (front() == other.front() && m_buffer->Step == other.m_buffer->Step));
+      }
+
+      return Items() == other.Items();
+    }
+
+  private:
+    struct Buffer
+    {
+      std::atomic<unsigned> RefCount;
+
+      const bool IsRange;
+      const T First;
+      const T Step;
+      const size_t Size;
+
+      std::once_flag Materialized;
+      std::vector<T> Items;
+    };
+
+    static T RangeItem(const Buffer& buffer, const size_t idx)
+    {
+      return static_cast<T>(buffer.First + buffer.Step * static_cast<T>(idx));
+    }
+
+    Buffer* m_buffer;
+  };
+
+  /**
+   * @brief Universal is a value of any type which is supported by Abacus.
+   *
+   * @note Universal takes 16 bytes: numbers are stored inline, sequences are shared arrays.
+   */
   struct Universal
   {
     enum class Types : unsigned char
@@ -21,15 +204,18 @@ namespace Abacus
 
     Types Type;
 
-    typedef std::vector<int> IntArray;
+    /** @brief Integer numbers are 64-bit. */
+    typedef std::int64_t Int;
+
+    typedef std::vector<Int> IntArray;
     typedef std::vector<double> RealArray;
 
     union
     {
-      int Integer;
+      Int Integer;
       double Real;
-      IntArray IntSequence;
-      RealArray RealSequence;
+      SharedArray<Int> IntSequence;
+      SharedArray<double> RealSequence;
     };
 
     Universal() : Type(Types::INVALID) { }
@@ -41,13 +227,20 @@ namespace Abacus
     Universal& operator=(Universal&& other);
 
     explicit Universal(int v) : Type(Types::INTEGER), Integer(v) {}
+    explicit Universal(Int v) : Type(Types::INTEGER), Integer(v) {}
     explicit Universal(double v) : Type(Types::REAL), Real(v) {}
 
     explicit Universal(IntArray&& sequence) : Type(Types::INT_SEQUENCE), IntSequence(std::move(sequence)) {}
-    explicit Universal(const IntArray& sequence) : Type(Types::INT_SEQUENCE), IntSequence(sequence) {}
+    explicit Universal(const IntArray& sequence) : Type(Types::INT_SEQUENCE), IntSequence(IntArray(sequence)) {}
+
+    explicit Universal(const std::vector<int>& sequence)
+      : Type(Types::INT_SEQUENCE), IntSequence(IntArray(sequence.cbegin(), sequence.cend())) {}
+
+    explicit Universal(SharedArray<Int>&& sequence) : Type(Types::INT_SEQUENCE), IntSequence(std::move(sequence)) {}
+    explicit Universal(SharedArray<double>&& sequence) : Type(Types::REAL_SEQUENCE), RealSequence(std::move(sequence)) {}
 
     explicit Universal(RealArray&& sequence) : Type(Types::REAL_SEQUENCE), RealSequence(std::move(sequence)) {}
-    explicit Universal(const RealArray& sequence) : Type(Types::REAL_SEQUENCE), RealSequence(sequence) {}
+    explicit Universal(const RealArray& sequence) : Type(Types::REAL_SEQUENCE), RealSequence(RealArray(sequence)) {}
 
     ~Universal();
 
@@ -57,6 +250,143 @@ namespace Abacus
     std::string ToString() const;
   };
 
+  static_assert(sizeof(Universal) == 16U, "Universal is expected to take 16 bytes.");
+
+  inline Universal::Universal(const Universal& other)
+    : Type(Types::INVALID)
+  {
+    switch(other.Type)
+    {
+      case Types::INTEGER:
+        Integer = other.Integer;
+        Type = other.Type;
+        break;
+      case Types::REAL:
+        Real = other.Real;
+        Type = other.Type;
+        break;
+      case Types::INT_SEQUENCE:
+        new (&IntSequence) decltype(IntSequence)(other.IntSequence);
+        Type = other.Type;
+        break;
+      case Types::REAL_SEQUENCE:
+        new (&RealSequence) decltype(RealSequence)(other.RealSequence);
+        Type = other.Type;
+        break;
+      default:
+        Type = Types::INVALID;
+    }
+  }
+
+  inline Universal::Universal(Universal&& other)
+    : Type(Types::INVALID)
+  {
+    switch(other.Type)
+    {
+      case Types::INTEGER:
+        Integer = other.Integer;
+        Type = other.Type;
+        break;
+      case Types::REAL:
+        Real = other.Real;
+        Type = other.Type;
+        break;
+      case Types::INT_SEQUENCE:
+        new (&IntSequence) decltype(IntSequence)(std::move(other.IntSequence));
+        Type = other.Type;
+        break;
+      case Types::REAL_SEQUENCE:
+        new (&RealSequence) decltype(RealSequence)(std::move(other.RealSequence));
+        Type = other.Type;
+        break;
+      default:
+        Type = Types::INVALID;
+    }
+
+    other.Type = Types::INVALID;
+  }
+
+  inline Universal::~Universal()
+  {
+    switch(Type)
+    {
+      case Types::INT_SEQUENCE:
+        IntSequence.~SharedArray<Int>();
+        break;
+      case Types::REAL_SEQUENCE:
+        RealSequence.~SharedArray<double>();
+        break;
+      default:
+        break;
+    }
+
+    Type = Types::INVALID;
+  }
+
+  inline Universal& Universal::operator=(const Universal& other)
+  {
+    if (this == &other)
+    {
+      return *this;
+    }
+
+    this->~Universal();
+
+    new (this) Universal(other);
+
+    return *this;
+  }
+
+  inline Universal& Universal::operator=(Universal&& other)
+  {
+    if (this == &other)
+    {
+      return *this;
+    }
+
+    this->~Universal();
+
+    new (this) Universal(std::move(other));
+
+    return *this;
+  }
+
+  /** @brief Throws parse_error("Overflow"). */
+  [[noreturn]] void ThrowOverflow();
+
+  inline Universal::Int AddIntegers(const Universal::Int l, const Universal::Int r)
+  {
+    Universal::Int result;
+    if (__builtin_add_overflow(l, r, &result))
+    {
+      ThrowOverflow();
+    }
+
+    return result;
+  }
+
+  inline Universal::Int SubIntegers(const Universal::Int l, const Universal::Int r)
+  {
+    Universal::Int result;
+    if (__builtin_sub_overflow(l, r, &result))
+    {
+      ThrowOverflow();
+    }
+
+    return result;
+  }
+
+  inline Universal::Int MulIntegers(const Universal::Int l, const Universal::Int r)
+  {
+    Universal::Int result;
+    if (__builtin_mul_overflow(l, r, &result))
+    {
+      ThrowOverflow();
+    }
+
+    return result;
+  }
+
   Universal Mul(const Universal& l, const Universal& r);
 
   Universal Add(const Universal& l, const Universal& r);
@@ -0,0 +1,393 @@
+#include "Vm.h"
+
+#include "Common.h"
+#include "MapParse.h"
+#include "ReduceParse.h"
+#include "SequenceParse.h"
+
+#include <tao/pegtl.hpp>
+
+#include <cmath>
+#include <algorithm>
+
+namespace Abacus
+{
+  namespace Vm
+  {
+    using tao::TAOCPP_PEGTL_NAMESPACE::parse_error;
+
+    static const Universal& LoadVariable(const unsigned slot, const Ast::Node& node, const Context& context)
+    {
+      if (context.Variables != nullptr && (*context.Variables)[slot] != nullptr)
+      {
+        return *(*context.Variables)[slot];
+      }
+
+      throw parse_error(Print("Undefined variable: %s", node.Name.c_str()), node.Pos);
+    }
+
+    static void SetInteger(Universal& u, const Universal::Int value)
+    {
+      // Numbers are assigned in place, sequences are released.
+      if (u.IsNumber())
+      {
+        u.Type = Universal::Types::INTEGER;
+        u.Integer = value;
+      }
+      else
+      {
+        u = Universal(value);
+      }
+    }
+
+    static void SetReal(Universal& u, const double value)
+    {
+      if (u.IsNumber())
+      {
+        u.Type = Universal::Types::REAL;
+        u.Real = value;
+      }
+      else
+      {
+        u = Universal(value);
+      }
+    }
+
+    const Function& GetVariant(const Module& module,
+                               const Lambda& lambda,
+                               const Universal::Types first,
+                               const Universal::Types second)
+    {
+      if (first == Universal::Types::INTEGER || first == Universal::Types::REAL)
+      {
+        if (second == Universal::Types::INTEGER || second == Universal::Types::REAL)
+        {
+          const unsigned idx = lambda.Variants[first == Universal::Types::REAL][second == Universal::Types::REAL];
+          if (idx != 0U)
+          {
+            return module.Functions[idx];
+          }
+        }
+      }
+
+      throw parse_error(Print("Internal error: lambda is not compiled for types %u and %u.",
+                              static_cast<unsigned>(first),
+                              static_cast<unsigned>(second)),
+                        {});
+    }
+
+    /**
+     * @brief Executes an instruction for a number of items of registers.
+     *
+     * Register k of item idx is r[k * STRIDE + idx], so a frame has the stride 1 and one item,
+     * and a batch has columns of Batch::SIZE items. ITEMS is the number of items if it is known
+     * at compile time, otherwise it is 0 and the number is passed in itemsNumber.
+     *
+     * @note RETURN is handled by the caller.
+     */
+    template< size_t STRIDE, size_t ITEMS >
+    static inline void ExecuteOp(const Module& module,
+                                 const Function& function,
+                                 const Instruction& instr,
+                                 const Context& context,
+                                 Universal* const r,
+                                 const size_t itemsNumber)
+    {
+      const size_t size = ITEMS != 0U ? ITEMS : itemsNumber;
+
+      // The node is looked up only by instructions which use it, so arithmetic stays cheap.
+      const auto node = [&function, &instr]() -> const Ast::Node&
+      {
+        return *function.Nodes[&instr - function.Code.data()];
+      };
+
+      Universal* const a = r + instr.A * STRIDE;
+      const Universal* const b = r + instr.B * STRIDE;
+      const Universal* const c = r + instr.C * STRIDE;
+
+      switch (instr.Op)
+      {
+        case OpCode::LOAD_VARIABLE:
+          for (size_t idx = 0; idx < size; ++idx)
+          {
+            a[idx] = LoadVariable(instr.B, node(), context);
+          }
+          break;
+
+        case OpCode::ADD:
+          for (size_t idx = 0; idx < size; ++idx)
+          {
+            a[idx] = Add(b[idx], c[idx]);
+          }
+          break;
+
+        case OpCode::SUB:
+          for (size_t idx = 0; idx < size; ++idx)
+          {
+            a[idx] = Sub(b[idx], c[idx]);
+          }
+          break;
+
+        case OpCode::MUL:
+          for (size_t idx = 0; idx < size; ++idx)
+          {
+            a[idx] = Mul(b[idx], c[idx]);
+          }
+          break;
+
+        case OpCode::DIV:
+          for (size_t idx = 0; idx < size; ++idx)
+          {
+            a[idx] = Div(b[idx], c[idx]);
+          }
+          break;
+
+        case OpCode::POW:
+          for (size_t idx = 0; idx < size; ++idx)
+          {
+            a[idx] = Pow(b[idx], c[idx]);
+          }
+          break;
+
+        case OpCode::ADD_INTEGER:
+          for (size_t idx = 0; idx < size; ++idx)
+          {
+            SetInteger(a[idx], AddIntegers(b[idx].Integer, c[idx].Integer));
+          }
+          break;
+
+        case OpCode::SUB_INTEGER:
+          for (size_t idx = 0; idx < size; ++idx)
+          {
+            SetInteger(a[idx], SubIntegers(b[idx].Integer, c[idx].Integer));
+          }
+          break;
+
+        case OpCode::MUL_INTEGER:
+          for (size_t idx = 0; idx < size; ++idx)
+          {
+            SetInteger(a[idx], MulIntegers(b[idx].Integer, c[idx].Integer));
+          }
+          break;
+
+        case OpCode::ADD_REAL:
+          for (size_t idx = 0; idx < size; ++idx)
+          {
+            SetReal(a[idx], b[idx].Real + c[idx].Real);
+          }
+          break;
+
+        case OpCode::SUB_REAL:
+          for (size_t idx = 0; idx < size; ++idx)
+          {
+            SetReal(a[idx], b[idx].Real - c[idx].Real);
+          }
+          break;
+
+        case OpCode::MUL_REAL:
+          for (size_t idx = 0; idx < size; ++idx)
+          {
+            SetReal(a[idx], b[idx].Real * c[idx].Real);
+          }
+          break;
+
+        case OpCode::DIV_REAL:
+          for (size_t idx = 0; idx < size; ++idx)
+          {
+            SetReal(a[idx], b[idx].Real / c[idx].Real);
+          }
+          break;
+
+        case OpCode::POW_REAL:
+          for (size_t idx = 0; idx < size; ++idx)
+          {
+            SetReal(a[idx], std::pow(b[idx].Real, c[idx].Real));
+          }
+          break;
+
+        case OpCode::TO_REAL:
+          for (size_t idx = 0; idx < size; ++idx)
+          {
+            SetReal(a[idx], static_cast<double>(b[idx].Integer));
+          }
+          break;
+
+        case OpCode::SEQUENCE:
+          for (size_t idx = 0; idx < size; ++idx)
+          {
+            a[idx] = Sequence::Calculate(node(), b[idx], c[idx]);
+          }
+          break;
+
+        case OpCode::MAP:
+          for (size_t idx = 0; idx < size; ++idx)
+          {
+            a[idx] = Map::Calculate(node(),
+                                    module,
+                                    module.Lambdas[instr.C],
+                                    context.Control,
+                                    context.Options,
+                                    b[idx]);
+          }
+          break;
+
+        case OpCode::REDUCE:
+          for (size_t idx = 0; idx < size; ++idx)
+          {
+            a[idx] = Reduce::Calculate(node(),
+                                       module,
+                                       module.Lambdas[instr.D],
+                                       context.Control,
+                                       context.Options,
+                                       b[idx],
+                                       c[idx]);
+          }
+          break;
+
+        case OpCode::MAP_REDUCE:
+          for (size_t idx = 0; idx < size; ++idx)
+          {
+            a[idx] = Reduce::CalculateMapped(node(),
+                                             module,
+                                             module.Lambdas[instr.E],
+                                             module.Lambdas[instr.D],
+                                             context.Control,
+                                             context.Options,
+                                             b[idx],
+                                             c[idx]);
+          }
+          break;
+
+        case OpCode::RETURN:
+          break;
+      }
+    }
+
+    static Universal Execute(const Module& module,
+                             const Function& function,
+                             const size_t entry,
+                             Frame& frame,
+                             const Context& context)
+    {
+      Universal* const r = frame.Registers.data();
+      const Instruction* const code = function.Code.data();
+      const Instruction* ip = code + entry;
+
+      try
+      {
+        for (;; ++ip)
+        {
+          if (ip->Op == OpCode::RETURN)
+          {
+            return r[ip->A];
+          }
+
+          ExecuteOp<1U, 1U>(module, function, *ip, context, r, 1U);
+        }
+      }
+      catch (const parse_error& err)
+      {
+        if (!err.positions.empty())
+        {
+          throw;
+        }
+
+        throw parse_error(err.what(), function.Nodes[ip - code]->Pos);
+      }
+      catch (const std::exception& err)
+      {
+        throw parse_error(err.what(), function.Nodes[ip - code]->Pos);
+      }
+    }
+
+    Frame::Frame(const Module& module, const Function& function, const Context& context)
+      : Registers(function.RegistersNumber)
+    {
+      std::copy(function.Constants.cbegin(),
+                function.Constants.cend(),
+                Registers.data() + function.Parameters.size());
+
+      if (function.Entry != 0U)
+      {
+        Execute(module, function, 0U, *this, context);
+      }
+    }
+
+    Universal Run(const Module& module, const Function& function, Frame& frame, const Context& context)
+    {
+      return Execute(module, function, function.Entry, frame, context);
+    }
+
+    Universal Calculate(const Module& module, const Context& context)
+    {
+      const Function& function = module.Functions.front();
+
+      Frame frame(module, function, context);
+
+      return Run(module, function, frame, context);
+    }
+
+    const size_t Batch::SIZE;
+
+    Batch::Batch(const Module& module, const Function& function, const Frame& frame, const Context& context)
+      : m_module(module),
+        m_function(function),
+        m_context(context),
+        m_columns(new Universal[function.RegistersNumber * SIZE])
+    {
+      std::vector<bool> isWritten(function.RegistersNumber, false);
+      isWritten[0] = true;
+
+      for (size_t idx = function.Entry; idx < function.Code.size(); ++idx)
+      {
+        if (function.Code[idx].Op != OpCode::RETURN)
+        {
+          isWritten[function.Code[idx].A] = true;
+        }
+      }
+
+      // Registers which are not written by the lambda keep the same value for all items.
+      for (unsigned reg = 0; reg < function.RegistersNumber; ++reg)
+      {
+        if (!isWritten[reg])
+        {
+          std::fill_n(m_columns.get() + reg * SIZE, SIZE, frame.Registers[reg]);
+        }
+      }
+    }
+
+    const Universal* Batch::Run(const size_t size)
+    {
+      Universal* const r = m_columns.get();
+
+      for (size_t instrIdx = m_function.Entry;; ++instrIdx)
+      {
+        const Instruction& instr = m_function.Code[instrIdx];
+        const Ast::Node& node = *m_function.Nodes[instrIdx];
+
+        if (instr.Op == OpCode::RETURN)
+        {
+          return r + instr.A * SIZE;
+        }
+
+        try
+        {
+          ExecuteOp<SIZE, 0U>(m_module, m_function, instr, m_context, r, size);
+        }
+        catch (const parse_error& err)
+        {
+          if (!err.positions.empty())
+          {
+            throw;
+          }
+
+          throw parse_error(err.what(), node.Pos);
+        }
+        catch (const std::exception& err)
+        {
+          throw parse_error(err.what(), node.Pos);
+        }
+      }
+    }
+  }
+}
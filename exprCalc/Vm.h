@@ -0,0 +1,220 @@
+#pragma once
+
+#include "Ast.h"
+#include "ExprCalc.h"
+#include "Universal.h"
+
+#include <memory>
+#include <string>
+#include <vector>
+
+namespace Abacus
+{
+  namespace Vm
+  {
+    enum class OpCode : unsigned char
+    {
+      LOAD_VARIABLE,  // R[A] = *Variables[B]
+      ADD,            // R[A] = R[B] + R[C]
+      SUB,            // R[A] = R[B] - R[C]
+      MUL,            // R[A] = R[B] * R[C]
+      DIV,            // R[A] = R[B] / R[C]
+      POW,            // R[A] = R[B] ^ R[C]
+
+      // Operations on values whose types are known at compile time.
+      ADD_INTEGER,    // R[A] = R[B] + R[C]
+      SUB_INTEGER,    // R[A] = R[B] - R[C]
+      MUL_INTEGER,    // R[A] = R[B] * R[C]
+      ADD_REAL,       // R[A] = R[B] + R[C]
+      SUB_REAL,       // R[A] = R[B] - R[C]
+      MUL_REAL,       // R[A] = R[B] * R[C]
+      DIV_REAL,       // R[A] = R[B] / R[C]
+      POW_REAL,       // R[A] = R[B] ^ R[C]
+      TO_REAL,        // R[A] = real(R[B]), R[B] is integer
+
+      SEQUENCE,       // R[A] = { R[B], R[C] }
+      MAP,            // R[A] = map(R[B], Lambdas[C])
+      REDUCE,         // R[A] = reduce(R[B], R[C], Lambdas[D])
+      MAP_REDUCE,     // R[A] = reduce(map(R[B], Lambdas[E]), R[C], Lambdas[D])
+      RETURN          // return R[A]
+    };
+
+    struct Instruction
+    {
+      OpCode Op;
+      unsigned short A;
+      unsigned short B;
+      unsigned short C;
+      unsigned short D;
+      unsigned short E;
+    };
+
+    /**
+     * @brief Function is a compiled expression or lambda body.
+     *
+     * @note Registers of a function are laid out as [parameters, constants, temporaries].
+     * @note Code before Entry is a prologue. It calculates parts of lambda which do not depend on
+     *       parameters, it is run once per frame and keeps its results in registers.
+     */
+    struct Function
+    {
+      std::vector<Instruction> Code;
+      size_t Entry;
+
+      /** @brief Source node of every instruction. It is used for error reporting. */
+      std::vector<const Ast::Node*> Nodes;
+
+      std::vector<std::string> Parameters;
+      std::vector<Universal> Constants;
+      unsigned RegistersNumber;
+
+      /** @brief Type of returned value. It is INVALID if the type is unknown at compile time. */
+      Universal::Types ResultType;
+    };
+
+    /**
+     * @brief Lambda is compiled separately for every combination of parameter types it can be called with.
+     *
+     * @note Variants[i][j] is index of the function for parameters of types INTEGER (0) or REAL (1).
+     *       map() lambdas use Variants[i][0]. Index 0 means that the variant is never called.
+     */
+    struct Lambda
+    {
+      unsigned short Variants[2][2];
+    };
+
+    /** @brief Module is a compiled expression together with all its lambdas. */
+    struct Module
+    {
+      /** @brief Functions[0] is the expression, other functions are lambda variants. */
+      std::vector<Function> Functions;
+
+      std::vector<Lambda> Lambdas;
+
+      /** @brief Expression tree which is referenced by Function::Nodes. */
+      Ast::NodePtr Tree;
+    };
+
+    struct Context
+    {
+      /** @brief Control of the calculation. It is nullptr if the calculation can not be terminated. */
+      ExecControl* const Control;
+      const ExecOptions& Options;
+
+      /**
+       * @brief Values of variables by slots. A slot is nullptr if the variable is not defined.
+       *        It is nullptr for lambdas.
+       */
+      const std::vector<const Universal*>* Variables;
+    };
+
+    /**
+     * @brief RegisterFile is an array of registers. Small arrays are kept inline, so calculation
+     *        of a simple expression does not allocate memory.
+     */
+    class RegisterFile
+    {
+    public:
+      explicit RegisterFile(const size_t size)
+        : m_heap(size > INLINE_SIZE ? new Universal[size] : nullptr),
+          m_data(m_heap != nullptr ? m_heap.get() : m_inline)
+      {
+      }
+
+      RegisterFile(const RegisterFile&) = delete;
+      RegisterFile& operator=(const RegisterFile&) = delete;
+
+      Universal* data() { return m_data; }
+      const Universal* data() const { return m_data; }
+
+      Universal& operator[](const size_t idx) { return m_data[idx]; }
+      const Universal& operator[](const size_t idx) const { return m_data[idx]; }
+
+    private:
+      static const size_t INLINE_SIZE = 16U;
+
+      Universal m_inline[INLINE_SIZE];
+      std::unique_ptr<Universal[]> m_heap;
+      Universal* const m_data;
+    };
+
+    /**
+     * @brief Frame holds registers of a function.
+     *
+     * @note Frame is created once and reused for calling a lambda for all items of a sequence.
+     */
+    struct Frame
+    {
+      /**
+       * @brief Creates frame and runs the function prologue.
+       *
+       * @throw parse_error if calculation of the prologue failed.
+       */
+      Frame(const Module& module, const Function& function, const Context& context);
+
+      RegisterFile Registers;
+    };
+
+    /**
+     * @brief Returns variant of lambda for parameters of given types.
+     *
+     * @throw parse_error if the variant was not compiled.
+     */
+    const Function& GetVariant(const Module& module,
+                               const Lambda& lambda,
+                               Universal::Types first,
+                               Universal::Types second = Universal::Types::INTEGER);
+
+    /**
+     * @brief Runs function. Parameters should be set in the frame registers before the call.
+     *
+     * @throw parse_error if calculation failed.
+     * @throw TerminatedError if termination was requested.
+     */
+    Universal Run(const Module& module, const Function& function, Frame& frame, const Context& context);
+
+    /** @brief Calculates compiled expression. */
+    Universal Calculate(const Module& module, const Context& context);
+
+    /**
+     * @brief Batch calculates a lambda of one parameter for a batch of its values.
+     *
+     * Every register is a column of values and every instruction is run for the whole batch, so
+     * dispatch of instructions is amortized over the batch. All instructions are supported,
+     * including nested sequence operations.
+     *
+     * @note Errors are reported in the order of instructions, not items. Callers which need
+     *       the error of the first failed item should recalculate the batch item by item.
+     */
+    class Batch
+    {
+    public:
+      /** @brief Maximal number of values in the batch. */
+      static const size_t SIZE = 256U;
+
+      /** @param frame Frame of the lambda with calculated prologue. */
+      Batch(const Module& module, const Function& function, const Frame& frame, const Context& context);
+
+      /** @brief Returns column of the parameter. Values [0, size) should be set before Run(). */
+      Universal* Parameter() { return m_columns.get(); }
+
+      /**
+       * @brief Calculates lambda for the first size values of the parameter.
+       *
+       * @return Column of results.
+       *
+       * @throw parse_error if calculation failed.
+       * @throw TerminatedError if termination was requested.
+       */
+      const Universal* Run(size_t size);
+
+    private:
+      const Module& m_module;
+      const Function& m_function;
+      const Context& m_context;
+
+      /** @brief Columns of registers. */
+      std::unique_ptr<Universal[]> m_columns;
+    };
+  }
+}
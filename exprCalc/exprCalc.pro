@@ -3,11 +3,49 @@ TEMPLATE = lib
 CONFIG+= staticlib
 
 SOURCES += ExprCalc.cpp \
-    Universal.cpp
+    Universal.cpp \
+    Vm.cpp \
+    Compiler.cpp \
+    Optimizer.cpp \
+    Kernel.cpp \
+    KernelSse2.cpp \
+    ThreadPool.cpp
+
+# Kernels of wider instruction sets are compiled with their own flags. They are selected at runtime
+# only when CPU supports them.
+AVX2_SOURCES = KernelAvx2.cpp
+AVX512_SOURCES = KernelAvx512.cpp
+
+msvc {
+  # MSVC has no flags enabling instruction sets per file, these sets are built empty.
+  SOURCES += $$AVX2_SOURCES $$AVX512_SOURCES
+} else {
+  avx2.input = AVX2_SOURCES
+  avx2.variable_out = OBJECTS
+  avx2.dependency_type = TYPE_C
+  avx2.output = ${QMAKE_VAR_OBJECTS_DIR}${QMAKE_FILE_IN_BASE}$${first(QMAKE_EXT_OBJ)}
+  avx2.commands = $${QMAKE_CXX} $(CXXFLAGS) -mavx2 $(INCPATH) -c ${QMAKE_FILE_IN} -o ${QMAKE_FILE_OUT}
+
+  avx512.input = AVX512_SOURCES
+  avx512.variable_out = OBJECTS
+  avx512.dependency_type = TYPE_C
+  avx512.output = ${QMAKE_VAR_OBJECTS_DIR}${QMAKE_FILE_IN_BASE}$${first(QMAKE_EXT_OBJ)}
+  avx512.commands = $${QMAKE_CXX} $(CXXFLAGS) -mavx512f -mavx512dq -mprefer-vector-width=512 $(INCPATH) -c ${QMAKE_FILE_IN} -o ${QMAKE_FILE_OUT}
+
+  QMAKE_EXTRA_COMPILERS += avx2 avx512
+}
 
 HEADERS += Common.h \
     ExprCalc.h \
     Universal.h \
+    Ast.h \
+    Vm.h \
+    Compiler.h \
+    Optimizer.h \
+    Kernel.h \
+    KernelIsa.h \
+    KernelLoops.h \
+    ThreadPool.h \
     StmtParse.h \
     ExprParse.h \
     BinaryStack.h \
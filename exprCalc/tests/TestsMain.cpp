@@ -1,8 +1,19 @@
 #include <cmath>
+#include <cstdio>
 #include <cstdlib>
+#include <cstring>
+#include <future>
+#include <chrono>
 #include <climits>
+#include <cstdint>
 #include <iostream>
+#include <sstream>
+#include <stdexcept>
 #include <memory>
+#include <mutex>
+#include <numeric>
+#include <thread>
+#include <vector>
 
 #include "exprCalc/ExprCalc.h"
 
@@ -156,14 +167,545 @@ unsigned CheckProgramPi()
   return 0;
 }
 
-int main()
+unsigned CheckCompiledProgram()
 {
+  const Abacus::Program program = Abacus::Compile(
+        "var s = map({1, n}, x -> x * x)\n"
+        "var r = reduce(s, 0, x y -> x + y)\n"
+        "out r");
+
+  if (!program.Errors().empty())
+  {
+    std::cout << "FAILED test for compiled program" << std::endl;
+    return 1U;
+  }
+
+  static const unsigned THREADS_NUM = 4U;
+  static const int RUNS_NUM = 50;
+
+  std::vector<unsigned> threadErrors(THREADS_NUM, 0U);
+  std::vector<std::thread> threads;
+
+  for (unsigned t = 0; t < THREADS_NUM; ++t)
+  {
+    threads.emplace_back([&program, &threadErrors, t]()
+    {
+      for (int n = 1; n <= RUNS_NUM; ++n)
+      {
+        const Abacus::ExecResult result = program.Run({ {"n", Abacus::Universal(n)} });
+
+        const int expected = n * (n + 1) * (2 * n + 1) / 6;
+        if (result.Brief != Abacus::ResultBrief::SUCCEEDED ||
+            result.Output != std::vector<std::string> { std::to_string(expected) } ||
+            result.Variables.at("r") != Abacus::Universal(expected))
+        {
+          ++threadErrors[t];
+        }
+      }
+    });
+  }
+
+  unsigned errorsNumber = 0U;
+  for (unsigned t = 0; t < THREADS_NUM; ++t)
+  {
+    threads[t].join();
+    errorsNumber += threadErrors[t];
+  }
+
+  if (errorsNumber != 0U)
+  {
+    std::cout << "FAILED test for compiled program" << std::endl;
+    return 1U;
+  }
+
+  std::cout << "PASSED test for compiled program" << std::endl;
+
+  return 0;
+}
+
+unsigned CheckLongRange()
+{
+  // Items of ranges are stored when they are compared with stored arrays.
+  Abacus::Universal::IntArray ascending(300000U);
+  std::iota(ascending.begin(), ascending.end(), -5);
+
+  Abacus::Universal::IntArray descending(ascending.crbegin(), ascending.crend());
+
+  if (Abacus::Calculate("{-5, 299994}", {}, nullptr) != Abacus::Universal(ascending) ||
+      Abacus::Calculate("{299994, -5}", {}, nullptr) != Abacus::Universal(descending))
+  {
+    std::cout << "FAILED test for long range" << std::endl;
+    return 1U;
+  }
+
+  // Returned sequences are limited as the output of map(), ranges inside of expressions are not.
+  if (Abacus::Calculate("{1, 4000000000000}", {}, nullptr).IsValid() ||
+      Abacus::Execute("var r = {1, 4000000000000}", {}, nullptr).Brief != Abacus::ResultBrief::FAILED ||
+      Abacus::Calculate("reduce({1, 2000001}, 0, x y -> x + y)", {}, nullptr) != Abacus::Universal(INT64_C(2000003000001)))
+  {
+    std::cout << "FAILED test for long range" << std::endl;
+    return 1U;
+  }
+
+  std::cout << "PASSED test for long range" << std::endl;
+
+  return 0;
+}
+
+unsigned CheckFailedStatement()
+{
+  // Statements after the failed one are independent of it, but their output and variables are discarded.
+  const Abacus::ExecResult result = Abacus::Execute(
+        "var a = reduce({1, 100000}, 0, x y -> x + y) out a out undefined var c = reduce({1, 3}, 0, x y -> x + y) out c",
+        {},
+        nullptr);
+
+  if (result.Brief != Abacus::ResultBrief::FAILED ||
+      result.Output != std::vector<std::string> { "5000050000" } ||
+      result.Variables.size() != 1U ||
+      result.Variables.count("a") != 1U)
+  {
+    std::cout << "FAILED test for failed statement" << std::endl;
+    return 1U;
+  }
+
+  std::cout << "PASSED test for failed statement" << std::endl;
+
+  return 0;
+}
+
+unsigned CheckFusedStatement()
+{
+  // The map() is fused into reduce() and never stored, otherwise it would exceed the maximum sequence size.
+  const Abacus::ExecResult reduced = Abacus::Execute(
+        "var m = map({1, 2000001}, x -> x * 2) var r = reduce(m, 0, x y -> x + y)",
+        {},
+        nullptr);
+
+  // The map() is fused into map().
+  const Abacus::ExecResult mapped = Abacus::Execute("var m = map({1, 3}, x -> x * 2) var r = map(m, y -> y + 1)",
+                                                    {},
+                                                    nullptr);
+
+  // The variable is used later, so it is not fused.
+  const Abacus::ExecResult kept = Abacus::Execute(
+        "var m = map({1, 3}, x -> x * 2) var r = reduce(m, 0, x y -> x + y) var s = m",
+        {},
+        nullptr);
+
+  if (reduced.Brief != Abacus::ResultBrief::SUCCEEDED ||
+      reduced.Variables.size() != 1U ||
+      reduced.Variables.count("m") != 0U ||
+      reduced.Variables.at("r") != Abacus::Universal(INT64_C(4000006000002)) ||
+      mapped.Brief != Abacus::ResultBrief::SUCCEEDED ||
+      mapped.Variables.size() != 1U ||
+      mapped.Variables.at("r") != Abacus::Universal(std::vector<int> { 3, 5, 7 }) ||
+      kept.Brief != Abacus::ResultBrief::SUCCEEDED ||
+      kept.Variables.size() != 3U ||
+      kept.Variables.at("m") != Abacus::Universal(std::vector<int> { 2, 4, 6 }) ||
+      kept.Variables.at("r") != Abacus::Universal(12))
+  {
+    std::cout << "FAILED test for fused statement" << std::endl;
+    return 1U;
+  }
+
+  std::cout << "PASSED test for fused statement" << std::endl;
+
+  return 0;
+}
+
+unsigned CheckExecOptions()
+{
+  static const std::string expression = "reduce(map({1, 100000}, x -> x * 3), 0, x y -> x + y)";
+
+  // Results of jobs fit, but their sum overflows.
+  static const std::string overflowExpression = "reduce(map({1, 4096}, x -> 4611686018427387), 0, x y -> x + y)";
+
+  const std::vector<Abacus::ExecOptions> options
+  {
+    Abacus::ExecOptions { 0U, 256U, true, false },
+    Abacus::ExecOptions { 1U, 256U, false, false },
+    Abacus::ExecOptions { 64U, 1U, false, false }
+  };
+
+  for (const auto& option : options)
+  {
+    if (Abacus::Calculate(expression, {}, nullptr, option) != Abacus::Universal(INT64_C(15000150000)) ||
+        Abacus::Calculate(overflowExpression, {}, nullptr, option).IsValid())
+    {
+      std::cout << "FAILED test for execution options" << std::endl;
+      return 1U;
+    }
+  }
+
+  std::cout << "PASSED test for execution options" << std::endl;
+
+  return 0;
+}
+
+unsigned CheckDeterministicReduce()
+{
+  static const std::string expression = "reduce(map({1, 1000000}, x -> 1.0 / x), 0, x y -> x + y)";
+
+  const Abacus::Universal expected = Abacus::Calculate(expression, {}, nullptr, Abacus::ExecOptions { 0U, 256U, true, true });
+
+  for (const unsigned threads : { 1U, 3U, 7U, 64U })
+  {
+    for (const size_t grainSize : { 1U, 256U, 100000U })
+    {
+      const Abacus::Universal result =
+          Abacus::Calculate(expression, {}, nullptr, Abacus::ExecOptions { threads, grainSize, false, true });
+
+      if (result.Type != Abacus::Universal::Types::REAL || result.Real != expected.Real)
+      {
+        std::cout << "FAILED test for deterministic reduce" << std::endl;
+        return 1U;
+      }
+    }
+  }
+
+  std::cout << "PASSED test for deterministic reduce" << std::endl;
+
+  return 0;
+}
+
+unsigned CheckNestedJobs()
+{
+  static const std::string expression =
+      "reduce(map({1, 2000}, x -> reduce({x, x + 300}, 0, a b -> a + b)), 0, a b -> a + b)";
+
+  // Every outer job waits for inner jobs, so waiting threads must not pick up other outer jobs endlessly.
+  const Abacus::Universal result = Abacus::Calculate(expression, {}, nullptr, Abacus::ExecOptions { 64U, 1U, false, false });
+
+  if (result != Abacus::Universal(INT64_C(692601000)))
+  {
+    std::cout << "FAILED test for nested jobs" << std::endl;
+    return 1U;
+  }
+
+  std::cout << "PASSED test for nested jobs" << std::endl;
+
+  return 0;
+}
+
+unsigned CheckExecControl()
+{
+  static const std::string expression = "reduce(map({1, 100000}, x -> x * 3), 0, x y -> x + y)";
+
+  // Items are counted by map() and reduce(), so the total is twice the sequence length.
+  Abacus::ExecControl control;
+  if (Abacus::Calculate(expression, {}, &control, Abacus::ExecOptions { 64U, 1U, false, false }) !=
+        Abacus::Universal(INT64_C(15000150000)) ||
+      control.ItemsTotal() != 200000U ||
+      control.ItemsDone() != 200000U)
+  {
+    std::cout << "FAILED test for progress of execution" << std::endl;
+    return 1U;
+  }
+
+  // A kernel reduce of one long job reports progress while it runs. The job is cancelled once progress is seen.
+  Abacus::ExecControl kernelControl;
+  Abacus::ExecHandle handle = Abacus::ExecuteAsync("out reduce({1, 2000000000}, 0, x y -> x + y)",
+                                                   {},
+                                                   &kernelControl,
+                                                   nullptr,
+                                                   Abacus::ExecOptions { 1U, 256U, false, false });
+
+  bool isProgressSeen = false;
+  while (handle.Result.wait_for(std::chrono::milliseconds(1)) != std::future_status::ready)
+  {
+    // The first item is reduced before the kernel starts, so it is not enough to see progress.
+    if (kernelControl.ItemsDone() >= 1000000U)
+    {
+      isProgressSeen = true;
+      kernelControl.Cancel();
+    }
+  }
+
+  if (!isProgressSeen || handle.Result.get().Brief != Abacus::ResultBrief::TERMINATED)
+  {
+    std::cout << "FAILED test for progress of kernel reduce" << std::endl;
+    return 1U;
+  }
+
+  Abacus::ExecControl cancelled;
+  Abacus::ExecControl child(&cancelled);
+  cancelled.Cancel();
+
+  if (!child.IsCancelled() ||
+      Abacus::Execute("var a = 1 out reduce({1, 100000}, 0, x y -> x + y)", {}, &child).Brief !=
+        Abacus::ResultBrief::TERMINATED ||
+      Abacus::Execute("var r = {1, 2000000}", {}, &child).Brief != Abacus::ResultBrief::TERMINATED)
+  {
+    std::cout << "FAILED test for cancelled execution" << std::endl;
+    return 1U;
+  }
+
+  std::cout << "PASSED test for execution control" << std::endl;
+
+  return 0;
+}
+
+unsigned CheckThrowingOutputHandler()
+{
+  const Abacus::Program program = Abacus::Compile(
+        "var a = map({1, 1000}, x -> x * 2)\n"
+        "var b = map({1, 1000}, x -> x * 3)\n"
+        "out reduce(a, 0, x y -> x + y)\n"
+        "out reduce(b, 0, x y -> x + y)");
+
+  // The statement whose output is rejected fails, following statements are not run.
+  for (const bool isSerial : { true, false })
+  {
+    unsigned callsNumber = 0U;
+    const Abacus::ExecResult result = program.Run(
+          {},
+          nullptr,
+          Abacus::ExecOptions { 0U, 256U, isSerial, false },
+          [&callsNumber](const std::string&)
+          {
+            ++callsNumber;
+            throw std::runtime_error("rejected");
+          });
+
+    if (result.Brief != Abacus::ResultBrief::FAILED ||
+        result.Errors.size() != 1U ||
+        result.Errors.front().Message != "Output handler failed. Reason: rejected" ||
+        !result.Output.empty() ||
+        result.Variables.size() != 2U ||
+        callsNumber != 1U)
+    {
+      std::cout << "FAILED test for throwing output handler" << std::endl;
+      return 1U;
+    }
+  }
+
+  std::cout << "PASSED test for throwing output handler" << std::endl;
+
+  return 0;
+}
+
+unsigned CheckExecuteAsync()
+{
+  std::mutex outputMutex;
+  std::vector<std::string> output;
+  Abacus::ExecControl parentControl;
+
+  // Statements are run concurrently, but output is passed in their order.
+  Abacus::ExecHandle handle = Abacus::ExecuteAsync(
+        "var a = reduce({1, 100000}, 0, x y -> x + y) var b = reduce({1, 1000}, 0, x y -> x + y) out b out a print \"end\"",
+        {},
+        &parentControl,
+        [&outputMutex, &output](const std::string& line)
+        {
+          std::lock_guard<std::mutex> lock(outputMutex);
+          output.push_back(line);
+        });
+
+  const Abacus::ExecResult result = handle.Result.get();
+  const std::vector<std::string> expected { "500500", "5000050000", "end" };
+
+  // Execution is terminated by the cancelled control of the caller.
+  Abacus::ExecControl cancelledControl;
+  cancelledControl.Cancel();
+
+  const Abacus::ExecResult cancelledResult =
+      Abacus::ExecuteAsync("var a = reduce({1, 100000}, 0, x y -> x + y)", {}, &cancelledControl).Result.get();
+
+  // The result of an execution whose handler throws is ready and reports the error.
+  const Abacus::ExecResult rejectedResult = Abacus::ExecuteAsync(
+        "var a = reduce({1, 100000}, 0, x y -> x + y) out a out a + 1",
+        {},
+        nullptr,
+        [](const std::string&) { throw std::runtime_error("rejected"); }).Result.get();
+
+  if (result.Brief != Abacus::ResultBrief::SUCCEEDED || result.Output != expected || output != expected ||
+      parentControl.ItemsTotal() == 0U || parentControl.ItemsDone() != parentControl.ItemsTotal() ||
+      cancelledResult.Brief != Abacus::ResultBrief::TERMINATED ||
+      rejectedResult.Brief != Abacus::ResultBrief::FAILED ||
+      rejectedResult.Errors.size() != 1U ||
+      rejectedResult.Errors.front().Message != "Output handler failed. Reason: rejected" ||
+      rejectedResult.Variables.count("a") != 1U)
+  {
+    std::cout << "FAILED test for asynchronous execution" << std::endl;
+    return 1U;
+  }
+
+  std::cout << "PASSED test for asynchronous execution" << std::endl;
+
+  return 0;
+}
+
+/*
+ * @brief Returns results of expressions which are calculated by kernel loops
+ */
+std::string KernelResults()
+{
+  static const std::vector<std::string> expressions
+  {
+    "map({1, 5000}, x -> x * 3 - 7)",
+    "map({1, 5000}, x -> x / 3 + x ^ 2)",
+    "map({1, 5000}, x -> (-1) ^ x * x)",
+    "map({1, 5000}, x -> x * 10000000000000000)",
+    "reduce({1, 100000}, 0, x y -> x + y)",
+    "reduce(map({1, 100000}, x -> 1.0 / x), 0, x y -> x + y)",
+    "reduce(map({1, 1000}, x -> 1 + 1 / x), 1, x y -> x * y)",
+    "reduce(map({1, 4096}, x -> 4611686018427387), 0, x y -> x + y)"
+  };
+
+  std::ostringstream results;
+  results << std::hexfloat;
+
+  for (const auto& expression : expressions)
+  {
+    const Abacus::Universal result =
+        Abacus::Calculate(expression, {}, nullptr, Abacus::ExecOptions { 1U, 256U, true, false });
+
+    results << expression << ": " << static_cast<unsigned>(result.Type);
+
+    if (result.Type == Abacus::Universal::Types::INT_SEQUENCE)
+    {
+      for (const auto item : result.IntSequence.Items())
+      {
+        results << " " << item;
+      }
+    }
+    else if (result.Type == Abacus::Universal::Types::REAL_SEQUENCE)
+    {
+      for (const auto item : result.RealSequence.Items())
+      {
+        results << " " << item;
+      }
+    }
+    else if (result.Type == Abacus::Universal::Types::INTEGER)
+    {
+      results << " " << result.Integer;
+    }
+    else if (result.Type == Abacus::Universal::Types::REAL)
+    {
+      results << " " << result.Real;
+    }
+
+    results << std::endl;
+  }
+
+  return results.str();
+}
+
+static void SetKernelIsa(const char* level)
+{
+#ifdef _WIN32
+  _putenv_s("ABACUS_KERNEL_ISA", level != nullptr ? level : "");
+#else
+  if (level != nullptr)
+  {
+    setenv("ABACUS_KERNEL_ISA", level, 1);
+  }
+  else
+  {
+    unsetenv("ABACUS_KERNEL_ISA");
+  }
+#endif
+}
+
+/*
+ * @brief Check that kernels of all instruction sets calculate the same results
+ *
+ * The instruction set is selected once per process, so the test program is run for every set
+ * with ABACUS_KERNEL_ISA. Sets which are not supported by CPU fall back to lower ones.
+ */
+unsigned CheckKernelIsa(const char* program)
+{
+  const char* const originalLevel = std::getenv("ABACUS_KERNEL_ISA");
+  const std::string original = originalLevel != nullptr ? originalLevel : "";
+
+  const std::string command = std::string("\"") + program + "\" --kernel-results 2>&1";
+
+  std::vector<std::string> results;
+  for (const char* level : { "sse2", "avx2", "avx512" })
+  {
+    SetKernelIsa(level);
+
+#ifdef _WIN32
+    FILE* const pipe = _popen(command.c_str(), "r");
+#else
+    FILE* const pipe = popen(command.c_str(), "r");
+#endif
+    if (pipe == nullptr)
+    {
+      break;
+    }
+
+    std::string output;
+    char buffer[4096];
+    for (size_t size = 0; (size = std::fread(buffer, 1U, sizeof(buffer), pipe)) != 0U;)
+    {
+      output.append(buffer, size);
+    }
+
+#ifdef _WIN32
+    const int status = _pclose(pipe);
+#else
+    const int status = pclose(pipe);
+#endif
+    if (status != 0 || output.empty())
+    {
+      break;
+    }
+
+    results.push_back(std::move(output));
+  }
+
+  SetKernelIsa(originalLevel != nullptr ? original.c_str() : nullptr);
+
+  if (results.size() != 3U || results[0] != results[1] || results[0] != results[2])
+  {
+    std::cout << "FAILED test for kernel instruction sets" << std::endl;
+    return 1U;
+  }
+
+  std::cout << "PASSED test for kernel instruction sets" << std::endl;
+
+  return 0;
+}
+
+int main(int argc, char* argv[])
+{
+  // The test program is run by CheckKernelIsa() to calculate results with the given instruction set.
+  if (argc == 2 && std::strcmp(argv[1], "--kernel-results") == 0)
+  {
+    std::cout << KernelResults();
+    return EXIT_SUCCESS;
+  }
+
   static const double MAX_SLOP = 0.0005;
 
   unsigned errorsNumber = 0;
 
   errorsNumber += CheckProgramPi();
 
+  errorsNumber += CheckCompiledProgram();
+
+  errorsNumber += CheckExecOptions();
+
+  errorsNumber += CheckFailedStatement();
+
+  errorsNumber += CheckFusedStatement();
+
+  errorsNumber += CheckLongRange();
+
+  errorsNumber += CheckDeterministicReduce();
+
+  errorsNumber += CheckNestedJobs();
+
+  errorsNumber += CheckExecControl();
+
+  errorsNumber += CheckThrowingOutputHandler();
+
+  errorsNumber += CheckExecuteAsync();
+
+  errorsNumber += CheckKernelIsa(argv[0]);
+
   errorsNumber += CheckStatement(
         "print \"pi = \"",
         { },
@@ -176,6 +718,62 @@ int main()
         Abacus::ExecResult { Abacus::ResultBrief::SUCCEEDED, {}, {"4"}, {} }
         );
 
+  errorsNumber += CheckStatement(
+        "var t = s var s = map(t, x -> x * 2)",
+        { {"s", Abacus::Universal(std::vector<int> {1, 2, 3})} },
+        Abacus::ExecResult
+        {
+          Abacus::ResultBrief::SUCCEEDED,
+          {},
+          {},
+          {
+            {"s", Abacus::Universal(std::vector<int> {2, 4, 6})},
+            {"t", Abacus::Universal(std::vector<int> {1, 2, 3})}
+          }
+        });
+
+  errorsNumber += CheckStatement(
+        "var b = a + 1 var a = b * 2 out a",
+        { {"a", Abacus::Universal(1)} },
+        Abacus::ExecResult
+        {
+          Abacus::ResultBrief::SUCCEEDED,
+          {},
+          {"4"},
+          {
+            {"a", Abacus::Universal(4)},
+            {"b", Abacus::Universal(2)}
+          }
+        });
+
+  errorsNumber += CheckStatement(
+        "var a = reduce({1, 100000}, 0, x y -> x + y) var b = reduce({1, 1000}, 0, x y -> x + y) out b print \"=\" out a",
+        { },
+        Abacus::ExecResult
+        {
+          Abacus::ResultBrief::SUCCEEDED,
+          {},
+          {"500500", "=", "5000050000"},
+          {
+            {"a", Abacus::Universal(INT64_C(5000050000))},
+            {"b", Abacus::Universal(500500)}
+          }
+        });
+
+  errorsNumber += CheckStatement(
+        "var a = 2 var b = 10 * a * 1 out b - 0",
+        { },
+        Abacus::ExecResult
+        {
+          Abacus::ResultBrief::SUCCEEDED,
+          {},
+          {"20"},
+          {
+            {"a", Abacus::Universal(2)},
+            {"b", Abacus::Universal(20)}
+          }
+        });
+
   errorsNumber += CheckExpression(
         " 4 * reduce( map({0, 50000}, i -> (-1.0)^i / (2.0 * i + 1)), 0, x y -> x + y )",
         {},
@@ -209,6 +807,121 @@ int main()
         {},
         Abacus::Universal(std::vector<int> {1, 4, 9, 16, 25}));
 
+  errorsNumber += CheckExpression(
+        "map({1, 3}, x -> reduce({1, x}, 0, i j -> i + j))",
+        {},
+        Abacus::Universal(std::vector<int> {1, 3, 6}));
+
+  errorsNumber += CheckExpression(
+        "reduce(map({1, 3000}, x -> x - 1), 1, x y -> x + y * 0)",
+        {},
+        Abacus::Universal(1));
+
+  errorsNumber += CheckExpression(
+        "map({1, 3}, x -> x + reduce({1, 4}, 0, i j -> i + j))",
+        {},
+        Abacus::Universal(std::vector<int> {11, 12, 13}));
+
+  errorsNumber += CheckExpression(
+        "map({1, 3}, x -> reduce({1, 3}, 0, i j -> i + j))",
+        {},
+        Abacus::Universal(std::vector<int> {6, 6, 6}));
+
+  errorsNumber += CheckInvalidExpression(
+        "map({1, 3}, x -> x + 9223372036854775807 * 2)",
+        {});
+
+  errorsNumber += CheckExpression(
+        "map(map({1, 4}, x -> x * 1.0), y -> y + 1)",
+        {},
+        Abacus::Universal(std::vector<double> {2., 3., 4., 5.}));
+
+  errorsNumber += CheckExpression(
+        "reduce(map({1, 4}, x -> x / 2), 0, x y -> x + y)",
+        {},
+        Abacus::Universal(5.));
+
+  errorsNumber += CheckExpression(
+        "reduce(map({1, 1000}, x -> 2 * x + 1 - x * x), 0, x y -> x + y)",
+        {},
+        Abacus::Universal(-332831500));
+
+  errorsNumber += CheckExpression(
+        "reduce(map({0, 599}, x -> (-1)^x * 2), 0, x y -> x + y)",
+        {},
+        Abacus::Universal(0.));
+
+  errorsNumber += CheckInvalidExpression(
+        "map({-1000, 1000}, x -> x * 4611686018427387904)",
+        {});
+
+  errorsNumber += CheckExpression(
+        "reduce({1, 3000000}, 0, x y -> y + x)",
+        {},
+        Abacus::Universal(INT64_C(4500001500000)));
+
+  errorsNumber += CheckExpression(
+        "reduce(map({1, 3000}, x -> x / 8), 0, x y -> x + y)",
+        {},
+        562687.5,
+        MAX_SLOP);
+
+  errorsNumber += CheckInvalidExpression(
+        "reduce(map({1, 3000}, x -> 1000 - x), 9223372036854774000, x y -> x + y)",
+        {});
+
+  errorsNumber += CheckInvalidExpression(
+        "reduce({1, 21}, 1, x y -> x * y)",
+        {});
+
+  errorsNumber += CheckExpression(
+        "reduce({1, 3000000}, 0, x y -> x + y * 0)",
+        {},
+        Abacus::Universal(0));
+
+  errorsNumber += CheckExpression(
+        "{3, 1}",
+        {},
+        Abacus::Universal(std::vector<int> {3, 2, 1}));
+
+  errorsNumber += CheckInvalidExpression(
+        "map({1, 3000000}, x -> x)",
+        {});
+
+  errorsNumber += CheckExpression(
+        "reduce(map({1, 3000000}, x -> x * 2), 0, x y -> x + y)",
+        {},
+        Abacus::Universal(INT64_C(9000003000000)));
+
+  errorsNumber += CheckExpression(
+        "reduce(map({1, 3000}, x -> reduce({1, x}, 0, i j -> i + j)), 0, x y -> x + y)",
+        {},
+        Abacus::Universal(INT64_C(4504501000)));
+
+  errorsNumber += CheckExpression(
+        "reduce(map({1, 1000}, x -> reduce({1, x}, 0, i j -> i + j) * 2 - x), 0, x y -> x + y)",
+        {},
+        Abacus::Universal(INT64_C(333833500)));
+
+  errorsNumber += CheckExpression(
+        "map({1, 4}, x -> reduce({x, x + 2000}, 0, i j -> i + j))",
+        {},
+        Abacus::Universal(std::vector<int> {2003001, 2005002, 2007003, 2009004}));
+
+  errorsNumber += CheckInvalidExpression(
+        "map({1, 2}, x -> reduce({x, x + 2000}, 0, i j -> i + j * 2305843009213693952))",
+        {});
+
+  errorsNumber += CheckInvalidExpression(
+        "map({1, 300}, x -> reduce({1, 2}, 0, i j -> i + j) + (x - 1) * 4611686018427387904)",
+        {});
+
+  errorsNumber += CheckInvalidExpression(
+        "map({1, 5}, x -> x + a)",
+        {
+          {"a", Abacus::Universal(1)},
+        });
+
   errorsNumber +=  CheckInvalidExpression(
         "(a + UNDEFINED_VARIABLE)",
         {
@@ -266,6 +979,7 @@ int main()
   errorsNumber += CheckExpression("(1 + -2 + -1*+2.0)", {},  Abacus::Universal(-3.0));
   errorsNumber += CheckExpression("((1 + -2 + -1*+2.0))", {},  Abacus::Universal(-3.0));
   errorsNumber += CheckExpression("((+1 + -2 + -1*+2.0 + 10 / (3 + 2)) + (4/2 + 1))+12/3", {},  Abacus::Universal(6.0));
+  errorsNumber += CheckExpression("2 * ((1 + 2) * (3 + (4 - 1)) - 1) + 1", {},  Abacus::Universal(35));
   errorsNumber += CheckExpression("1 + 2^(3+1)", {},  Abacus::Universal(17.));
   errorsNumber += CheckExpression("1 + 2^(3.0+1)", {},  Abacus::Universal(17.));
   errorsNumber += CheckExpression("1 + 2.0^(3+1)", {},  Abacus::Universal(17.));
@@ -274,32 +988,42 @@ int main()
   errorsNumber += CheckInvalidExpression(
         "a + b",
         {
-          {"a", Abacus::Universal(INT_MAX)},
-          {"b", Abacus::Universal(INT_MAX)},
+          {"a", Abacus::Universal(INT64_MAX)},
+          {"b", Abacus::Universal(INT64_MAX)},
         });
 
   errorsNumber += CheckInvalidExpression(
         "a + b",
         {
-          {"a", Abacus::Universal(INT_MIN)},
-          {"b", Abacus::Universal(INT_MIN)},
+          {"a", Abacus::Universal(INT64_MIN)},
+          {"b", Abacus::Universal(INT64_MIN)},
         });
 
   errorsNumber += CheckInvalidExpression(
         "a - b",
         {
-          {"a", Abacus::Universal(INT_MIN)},
-          {"b", Abacus::Universal(INT_MAX)},
+          {"a", Abacus::Universal(INT64_MIN)},
+          {"b", Abacus::Universal(INT64_MAX)},
         });
 
   errorsNumber += CheckInvalidExpression(
         "a - b",
         {
-          {"a", Abacus::Universal(INT_MAX)},
-          {"b", Abacus::Universal(INT_MIN)},
+          {"a", Abacus::Universal(INT64_MAX)},
+          {"b", Abacus::Universal(INT64_MIN)},
         });
 
 
+  errorsNumber += CheckExpression(
+        "a + b",
+        {
+          {"a", Abacus::Universal(INT_MAX)},
+          {"b", Abacus::Universal(INT_MAX)},
+        },
+        Abacus::Universal(2 * static_cast<Abacus::Universal::Int>(INT_MAX)));
+
+  errorsNumber += CheckExpression("reduce({1, 20}, 1, x y -> x * y)", {}, Abacus::Universal(INT64_C(2432902008176640000)));
+
   errorsNumber += CheckStatement(
         "var a = 5",
         { },
@@ -320,6 +1044,17 @@ int main()
           }
         });
 
+  errorsNumber += CheckStatement(
+        "var m = map({1, 5}, x -> x * 2) var r = map(m, y -> y + 1) out reduce(r, 0, x y -> x + y)",
+        { },
+        Abacus::ExecResult
+        {
+          Abacus::ResultBrief::SUCCEEDED,
+          {},
+          {"35"},
+          {}
+        });
+
   errorsNumber += CheckStatement(
         "var a = 1 var b = 2",
         { },